@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // accept4()
 #include <stdio.h>      // NULL, fprintf(), perror(), setlinebuf()
 #include <string.h>     // strcmp()
 #include <stdlib.h>     // NULL, EXIT_FAILURE, EXIT_SUCCESS
@@ -9,6 +10,22 @@
 #include <signal.h>     // sigaction(), ...
 #include <time.h>
 #include <sys/ioctl.h>	// ioctl() to get terminal dimensions
+#include <sys/mman.h>   // mmap(), munmap()
+#include <sys/stat.h>   // fstat()
+#include <fcntl.h>      // open()
+#include <sys/socket.h> // socket(), bind(), listen(), accept4(), ...
+#include <sys/un.h>     // struct sockaddr_un
+#include <strings.h>    // strcasecmp()
+#include <limits.h>     // INT_MAX
+#include <stdatomic.h>  // atomic_load_explicit(), atomic_store_explicit(), ...
+#include <sys/syscall.h> // SYS_futex
+#include <linux/futex.h> // FUTEX_WAKE
+#include <stdarg.h>     // va_list, va_start(), va_end()
+#include <stddef.h>     // offsetof()
+#include <netdb.h>      // getaddrinfo()
+#include <poll.h>       // poll()
+#include <locale.h>     // setlocale()
+#include <wchar.h>      // wcwidth()
 #include "libtwirc.h"
 
 #define VERSION_MAJOR 0
@@ -25,6 +42,100 @@
 #define DEFAULT_TIMESTAMP "[%H:%M:%S]"
 
 #define TIMESTAMP_BUFFER 16 
+#define UUID_BUFFER      37
+#define ARENA_SIZE       16384  // scratch memory for processing one message
+#define ALLOC_WARMUP     1000   // messages processed before we count allocs
+#define SERVICE_TICK     100    // twirc_tick() timeout (ms) while serving clients
+
+// archive format, see the archive section further down
+
+#define ARCHIVE_MAGIC      "LURPARC1"
+#define ARCHIVE_FOOT_MAGIC "LURPIDX1"
+#define ARCHIVE_HEAD_SIZE  16   // magic (8) + block size (4) + reserved (4)
+#define ARCHIVE_FOOT_SIZE  24   // magic (8) + dict offset (8) + index offset (8)
+#define ARCHIVE_BLOCK_HEAD 12   // first timestamp (8) + records (2) + used (2)
+#define ARCHIVE_BLOCK_SIZE 4096
+#define ARCHIVE_INDEX_SIZE 16384 // initial index capacity (blocks)
+
+#define ARCHIVE_FLAG_ACTION 1   // record is an action ("/me") message
+#define ARCHIVE_FLAG_ID     2   // record carries a 16 byte message id
+#define ARCHIVE_FLAG_TOMBSTONE 4 // record deletes messages, see message_s
+#define ARCHIVE_FLAG_DICT   8   // record defines the next dictionary string
+#define ARCHIVE_FLAG_CHAN   16  // record carries the channel's dictionary id
+#define ARCHIVE_FLAG_NOTICE 32  // record is a notice, see message_s
+#define ARCHIVE_DICT_MAX_LEN 256 // longer strings don't go into the dictionary
+#define ARCHIVE_DICT_STRINGS 65536   // initial dictionary capacity (strings)
+#define ARCHIVE_DICT_POOL    4194304 // initial dictionary capacity (bytes)
+
+// fan-out server, see the fan-out section further down
+
+#define FANOUT_RING        512  // events kept around for clients to catch up
+#define FANOUT_SLOT_SIZE   2048 // max size of a serialized event
+#define FANOUT_LINE_SIZE   256  // max size of a client's subscription line
+#define FANOUT_MAX_CLIENTS 64
+
+#define FANOUT_FORMAT_RAW  0    // raw IRC message
+#define FANOUT_FORMAT_TSV  1    // tab-separated values
+#define FANOUT_FORMAT_JSON 2    // JSON object
+#define FANOUT_FORMATS     3
+
+// render plans, see the render plan section further down
+
+#define RENDER_MAX_OPS 64
+#define RENDER_BUFFER  4096     // max size of a rendered line
+#define RENDER_TMP_BUFFER 64    // max size of a rendered timestamp or color
+
+#define RENDER_LITERAL      1   // literal part of the format string
+#define RENDER_TIMESTAMP    2   // %t
+#define RENDER_BADGE        3   // %b
+#define RENDER_NICK         4   // %n, user name
+#define RENDER_DNAME        5   // %n, display name where available
+#define RENDER_TEXT         6   // %m
+#define RENDER_CHAN         7   // %c
+#define RENDER_ID           8   // %i
+#define RENDER_COLOR_2BIT   9
+#define RENDER_COLOR_4BIT  10
+#define RENDER_COLOR_8BIT  11
+#define RENDER_COLOR_TRUE  12
+#define RENDER_COLOR_RESET 13
+
+// full-screen mode, see the full-screen section further down
+
+#define SCREEN_FPS        30    // max frames per second
+#define SCREEN_ENTRIES    1024  // messages kept around for (re)painting
+#define SCREEN_TEXT_SIZE  1024  // max size of a message's text
+#define SCREEN_LINE_CELLS 1200  // max cells of a laid out message
+#define SCREEN_MAX_SGR    32    // max size of a color escape sequence
+#define SCREEN_CELL_BYTES 8     // max size of a cell's UTF-8 (incl. combining marks)
+#define SCREEN_NO_COLOR   0xFFFFFFFF
+#define SCREEN_INDEX_SIZE 2048  // slots of the id and user indexes (power of 2)
+#define SCREEN_DELETIONS  64    // deletions queued until the next frame
+#define SCREEN_DELETED    "<message deleted>"
+
+// sampling, see the sampling section further down
+
+#define SAMPLE_MIN 0.0001       // never keep less than this fraction of chatters
+
+// metrics, see the metrics section further down
+
+#define METRICS_MAX_THREADS 8
+#define METRICS_MAX_CLIENTS 8
+#define METRICS_BUCKETS     13    // histogram buckets, excluding +Inf
+#define METRICS_BUFFER      8192  // max size of a scrape response body
+#define METRICS_TIMEOUT     5000  // time a scraper gets to send its request (ms)
+
+// shared-memory ring, see the shared-memory section further down
+
+#define SHM_MAGIC     "LURPSHM1"
+#define SHM_SLOTS     4096
+#define SHM_SLOT_SIZE 2048      // max size of a record, including its header
+#define SHM_NO_COLOR  0xFFFFFFFF
+
+#define EVENT_ACTION 1          // action ("/me") message
+#define EVENT_MOD    2          // sent by a mod or the broadcaster
+#define EVENT_SUB    4          // sent by a subscriber
+#define EVENT_TOMBSTONE 8       // deletes messages, see message_s
+#define EVENT_NOTICE 16         // notice from the server, see message_s
 
 // https://en.wikipedia.org/wiki/ANSI_escape_code
 
@@ -47,6 +158,68 @@
 static volatile int running; // stop main loop in case of SIGINT etc
 static volatile int resized; // signal that the terminal size changed 
 
+// Build with -DALLOC_STATS to count heap allocations. This is meant for 
+// verifying that processing messages doesn't allocate once warmed up, for
+// example by playing back a big archive with -p (see the alloc-test script).
+// Our replacements simply count and then hand over to glibc's implementation.
+// Only process_message() is checked: libtwirc allocates while parsing every
+// message in twirc_tick(), which is out of our hands; those allocations are
+// counted and reported separately.
+#ifdef ALLOC_STATS
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+
+static size_t allocs;        // heap allocations overall
+static size_t allocs_hot;    // heap allocations in the hot path after warm-up
+static size_t allocs_tick;   // heap allocations in twirc_tick(), but not in
+                             // process_message(), so mostly by libtwirc
+static size_t processed;     // messages processed so far
+static int hot;              // currently in the hot path, after warm-up
+static int in_message;       // currently in process_message()
+static int in_tick;          // currently in twirc_tick()
+
+static void
+alloc_count()
+{
+	allocs++;
+	allocs_hot += hot;
+	allocs_tick += in_tick && !in_message;
+}
+
+void *malloc(size_t size)
+{
+	alloc_count();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size)
+{
+	alloc_count();
+	return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count();
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+#define ALLOC_STATS_ENTER() (in_message = 1, hot = ++processed > ALLOC_WARMUP)
+#define ALLOC_STATS_LEAVE() (in_message = 0, hot = 0)
+#define ALLOC_STATS_TICK(t) (in_tick = (t))
+#else
+#define ALLOC_STATS_ENTER()
+#define ALLOC_STATS_LEAVE()
+#define ALLOC_STATS_TICK(t)
+#endif
+
 typedef struct rgb_color 
 {
 	unsigned r;
@@ -59,11 +232,22 @@ typedef struct options
 {
 	char *chan;               // Channel to join
 	char *timestamp;          // Timestamp format
+	char *archive;            // Archive file to write messages to
+	char *playback;           // Archive file to read messages from
+	char *socket;             // Unix domain socket to serve messages on
+	char *shm;                // Shared memory object to publish messages to
+	char *format;             // Output format string
+	char *metrics;            // Address to serve metrics on
+	double sample;            // Fraction of chatters to keep
+	int budget;               // Max messages per second when sampling
+	uint64_t from;            // Playback start time (ms since epoch)
+	uint64_t to;              // Playback end time (ms since epoch)
 	uint8_t colormode;        // Color mode
 	uint8_t align: 1;         // Align/pad nicks and messages
 	uint8_t badges : 1;       // Print sub/mod 'badges'
 	uint8_t twitchtime : 1;   // Use the Twitch provided timestamp
 	uint8_t displaynames : 1; // Favor display over user names
+	uint8_t fullscreen : 1;   // Full-screen mode
 	uint8_t help : 1;
 	uint8_t version : 1;
 	uint16_t term_width;	  // Terminal width in characters
@@ -71,6 +255,289 @@ typedef struct options
 }
 options_s;
 
+typedef struct message
+{
+	uint64_t ts;              // Time sent (ms since epoch)
+	char const *chan;         // Channel the message was sent to
+	char const *nick;         // User name of the sender
+	char const *dname;        // Display name of the sender, if any
+	char const *color;        // Color ("#RRGGBB") of the sender, if any
+	char const *badges;       // "badges" tag of the sender, if any
+	char const *id;           // Message id (UUID), if any
+	char const *raw;          // Raw IRC message, if any
+	char *text;               // Message text, might get modified
+	uint8_t action : 1;       // Action ("/me") message
+	uint8_t tombstone : 1;    // Deletes the message id, else all messages 
+	                          // of nick, else all messages; text is empty
+	uint8_t notice : 1;       // Sub, raid or change of the chat settings; 
+	                          // text is Twitch's description of it
+}
+message_s;
+
+typedef struct archive_dict
+{
+	uint32_t *offs;           // Offsets of the strings in pool, by id - 1
+	uint32_t *slots;          // Hash table of string ids (0 = empty)
+	uint32_t count;           // Number of strings
+	uint32_t size;            // Capacity of offs, half the slots
+	char *pool;               // Memory the strings live in
+	size_t pool_used;         // Bytes of pool used
+	size_t pool_size;         // Capacity of pool
+}
+archive_dict_s;
+
+typedef struct archive
+{
+	FILE *fp;                 // Archive file being written
+	archive_dict_s dict;      // Nicks, colors and badges seen so far
+	uint64_t *index;          // First timestamp of every written block
+	size_t blocks;            // Number of written blocks
+	size_t index_size;        // Capacity of index
+	uint64_t first_ts;        // Timestamp of current block's first record
+	uint64_t last_ts;         // Timestamp of the last record written
+	uint16_t records;         // Number of records in current block
+	uint16_t used;            // Bytes used in current block
+	unsigned char block[ARCHIVE_BLOCK_SIZE];
+}
+archive_s;
+
+typedef struct archive_record
+{
+	uint64_t delta;           // Time delta to the previous record (ms)
+	uint64_t flags;           // ARCHIVE_FLAG_*
+	uint64_t ids[5];          // Ids of nick, display name, color, badges and
+	                          // channel (0 without ARCHIVE_FLAG_CHAN)
+	unsigned char const *id;  // Message id (16 bytes), if any
+	unsigned char const *str; // Message text or defined string
+	uint64_t len;             // Length of str
+}
+archive_record_s;
+
+typedef struct arena
+{
+	char *buf;                // Memory to hand out
+	size_t size;              // Size of buf
+	size_t used;              // Bytes handed out since the last reset
+}
+arena_s;
+
+typedef struct strbuf
+{
+	char *buf;                // Buffer, not necessarily NUL-terminated
+	size_t size;              // Size of buf
+	size_t len;               // Bytes used
+}
+strbuf_s;
+
+typedef struct render_op
+{
+	uint8_t type;                       // RENDER_*
+	uint8_t action : 1;                 // Only for action ("/me") messages
+	uint16_t len;                       // Length of str
+	char const *str;                    // Literal, not NUL-terminated
+}
+render_op_s;
+
+typedef struct render_plan
+{
+	char const *timestamp;              // Timestamp format for %t
+	size_t count;                       // Number of ops
+	render_op_s ops[RENDER_MAX_OPS];
+}
+render_plan_s;
+
+typedef struct fanout_slot
+{
+	uint8_t flags;                      // EVENT_* flags of the event
+	char nick[TWIRC_NICK_SIZE];         // User name, for filtering
+	char text[FANOUT_SLOT_SIZE];        // Message text, for filtering
+	uint16_t len[FANOUT_FORMATS];       // Length of the serialized event
+	char data[FANOUT_FORMATS][FANOUT_SLOT_SIZE]; // Serialized event
+}
+fanout_slot_s;
+
+typedef struct fanout_client
+{
+	int fd;                             // Socket, -1 if unused
+	uint8_t subscribed : 1;             // Subscription line has been read
+	uint8_t format;                     // FANOUT_FORMAT_*
+	uint8_t flags;                      // EVENT_* flags events need to have
+	char nick[TWIRC_NICK_SIZE];         // Only events by this user
+	char match[FANOUT_LINE_SIZE];       // Only events containing this
+	char line[FANOUT_LINE_SIZE];        // Subscription line read so far
+	size_t line_len;                    // Length of line
+	uint64_t seq;                       // Next event to send
+	size_t off;                         // Bytes of that event already sent
+}
+fanout_client_s;
+
+typedef struct fanout
+{
+	int fd;                             // Listening socket
+	char const *path;                   // Path of the listening socket
+	uint64_t head;                      // Number of events published
+	fanout_slot_s *ring;                // The last FANOUT_RING events
+	unsigned subscribers[FANOUT_FORMATS]; // Clients per format
+	uint64_t dropped;                   // Clients dropped for being slow
+	fanout_client_s clients[FANOUT_MAX_CLIENTS];
+}
+fanout_s;
+
+typedef struct shm_head
+{
+	char magic[8];                      // SHM_MAGIC
+	uint32_t slot_size;                 // SHM_SLOT_SIZE
+	uint32_t slots;                     // SHM_SLOTS
+	_Atomic uint64_t head;              // Number of records published
+	_Atomic uint32_t futex;             // Incremented for every record
+	_Atomic uint32_t waiters;           // Consumers waiting on futex
+	unsigned char pad[32];              // Fill up to 64 bytes
+}
+shm_head_s;
+
+typedef struct shm_record
+{
+	_Atomic uint64_t seq;               // Record number + 1, 0 while writing
+	uint64_t ts;                        // Time sent (ms since epoch)
+	uint32_t color;                     // 0xRRGGBB or SHM_NO_COLOR
+	uint8_t flags;                      // EVENT_* flags
+	uint8_t nick_len;                   // Length of nick, without '\0'
+	uint16_t text_len;                  // Length of text, without '\0'
+	char data[];                        // Nick and text, both '\0'-terminated
+}
+shm_record_s;
+
+typedef struct shm_ring
+{
+	char const *name;                   // Name of the shared memory object
+	size_t size;                        // Size of the mapping
+	shm_head_s *head;                   // Start of the mapping
+	unsigned char *slots;               // First slot
+}
+shm_ring_s;
+
+typedef struct screen_cell
+{
+	uint32_t color;                     // 0xRRGGBB or SCREEN_NO_COLOR
+	char ch[SCREEN_CELL_BYTES];         // UTF-8 sequence, zero-padded
+	uint32_t len;                       // Length of the UTF-8 sequence, 0 for
+	                                    // the right half of a wide character
+}
+screen_cell_s;
+
+typedef struct screen_entry
+{
+	uint8_t status : 1;                 // Status line, not a chat message
+	uint8_t action : 1;                 // Action ("/me") message
+	uint8_t deleted : 1;                // Deleted by a moderator
+	uint8_t has_id : 1;                 // id is set
+	uint32_t color;                     // 0xRRGGBB of the nick
+	uint64_t prev;                      // User's previous entry + 1 or 0
+	unsigned char id[16];               // Message id
+	char user[TWIRC_NICK_SIZE];         // User name, for deletions
+	char head[TIMESTAMP_BUFFER];        // Timestamp
+	char nick[TWIRC_NICK_SIZE + 1];     // Badge and nick
+	char text[SCREEN_TEXT_SIZE];        // Message text
+}
+screen_entry_s;
+
+typedef struct screen_deletion
+{
+	uint64_t before;                    // Only entries added before this
+	uint8_t has_id : 1;                 // Delete by id, otherwise by user
+	unsigned char id[16];               // Message id
+	char user[TWIRC_NICK_SIZE];         // User name, empty = all entries
+}
+screen_deletion_s;
+
+typedef struct screen
+{
+	int colormode;                      // COLOR_MODE_*
+	uint16_t width;                     // Terminal width
+	uint16_t height;                    // Terminal height
+	screen_entry_s *entries;            // The last SCREEN_ENTRIES messages
+	uint64_t head;                      // Number of entries added
+	uint64_t painted;                   // Value of head at the last frame
+	uint64_t next_frame;                // Earliest time for the next frame
+	screen_cell_s *front;               // Cells as shown on the terminal
+	screen_cell_s *back;                // Cells for the next frame
+	screen_cell_s *line;                // Scratch for laying out entries
+	size_t *rows;                       // Scratch: first cell of every row
+	char *out;                          // Escape sequences for one frame
+	size_t out_size;                    // Size of out
+	uint64_t *ids;                      // Index: entry number + 1 by id
+	uint64_t *users;                    // Index: user's latest entry + 1
+	uint64_t cleared;                   // Entries before this are deleted
+	size_t deletions;                   // Number of queued deletions
+	screen_deletion_s pending[SCREEN_DELETIONS]; // Queued deletions
+	uint8_t dirty : 1;                  // Entries added since last frame
+	uint8_t full : 1;                   // Next frame needs a full repaint
+}
+screen_s;
+
+typedef struct sampler
+{
+	double fraction;                    // Fraction of chatters to keep
+	double max;                         // Upper limit for fraction
+	uint32_t threshold;                 // Keep hashes up to this
+	unsigned budget;                    // Messages per second, 0 = none
+	uint64_t window;                    // Start of the current second
+	uint64_t kept;                      // Messages kept in that second
+	uint64_t dropped;                   // Messages dropped overall
+}
+sampler_s;
+
+typedef struct histogram
+{
+	_Atomic uint64_t buckets[METRICS_BUCKETS + 1]; // Observations per bucket
+	_Atomic uint64_t sum;               // Sum of all observations (ns)
+}
+histogram_s;
+
+typedef struct metrics
+{
+	_Atomic uint64_t messages;          // Chat messages processed
+	_Atomic uint64_t bytes;             // Bytes of chat output written to stdout
+	_Atomic uint64_t disconnects;       // Disconnects from the chat server
+	histogram_s render;                 // Time spent processing a message
+	histogram_s tick;                   // Time twirc_tick() spent processing
+}
+metrics_s;
+
+typedef struct metrics_server
+{
+	int fd;                             // Listening socket
+	char const *path;                   // Path of the socket, if Unix domain
+	int clients[METRICS_MAX_CLIENTS];   // Scrapers waiting for a response
+	uint64_t since[METRICS_MAX_CLIENTS]; // When they connected (ns)
+	char body[METRICS_BUFFER];          // Response body
+}
+metrics_server_s;
+
+typedef struct state
+{
+	options_s *opts;          // Command line options
+	archive_s *archive;       // Archive being written, if any
+	fanout_s *fanout;         // Fan-out server, if any
+	shm_ring_s *ring;         // Shared-memory ring, if any
+	render_plan_s *plan;      // Render plan for -f, if any
+	arena_s arena;            // Scratch memory for processing messages
+	screen_s *screen;         // Screen in full-screen mode
+	sampler_s *sampler;       // Sampler, if sampling
+	metrics_server_s *metrics; // Metrics endpoint, if any
+	uint64_t tick_busy;       // First message of the current tick (ns), or 0
+}
+state_s;
+
+// Upper bounds (ns) of the histogram buckets
+static const uint64_t metrics_bounds[METRICS_BUCKETS] = {
+	1000, 5000, 10000, 50000, 100000, 500000, 1000000, 
+	5000000, 10000000, 50000000, 100000000, 500000000, 1000000000
+};
+
+static metrics_s metrics_blocks[METRICS_MAX_THREADS]; // one per thread
+static _Atomic int metrics_threads;                   // blocks handed out
+
 static int
 color_mode(const char *mode, int fallback)
 {
@@ -102,7 +569,9 @@ parse_args(int argc, char **argv, options_s *opts)
 {
 	opterr = 0;
 	int o;
-	while ((o = getopt(argc, argv, "abc:dhm:rt:V")) != -1)
+	char *end;
+	long val;
+	while ((o = getopt(argc, argv, "abB:c:dE:f:FhL:m:M:p:rS:t:u:Vw:x:")) != -1)
 	{
 		switch(o)
 		{
@@ -112,25 +581,65 @@ parse_args(int argc, char **argv, options_s *opts)
 			case 'b':
 				opts->badges = 1;
 				break;
+			case 'B':
+				opts->from = strtoull(optarg, NULL, 10) * 1000;
+				break;
 			case 'c':
 				opts->chan = optarg;
 				break;
 			case 'd':
 				opts->displaynames = 1;
 				break;
+			case 'f':
+				opts->format = optarg;
+				break;
+			case 'F':
+				opts->fullscreen = 1;
+				break;
+			case 'E':
+				opts->to = strtoull(optarg, NULL, 10) * 1000 + 999;
+				break;
 			case 'h':
 				opts->help = 1;
+				break;
+			case 'L':
+				// Anything but a positive number gets rejected in main()
+				val = strtol(optarg, &end, 10);
+				opts->budget = (end == optarg || *end || val <= 0 || val > INT_MAX) ? -1 : val;
+				break;
 			case 'm':
 				opts->colormode = color_mode(optarg, COLOR_MODE_MONO);
 				break;
+			case 'M':
+				opts->shm = optarg;
+				break;
+			case 'p':
+				opts->playback = optarg;
+				break;
 			case 'r':
 				opts->twitchtime = 1;
 				break;
+			case 'S':
+				// Anything but a number in (0, 1] gets rejected in main(); 
+				// 0 would otherwise be mistaken for no sampling at all
+				opts->sample = strtod(optarg, &end);
+				opts->sample = (end == optarg || *end || opts->sample == 0.0) ? -1.0 : opts->sample;
+				break;
 			case 't':
 				opts->timestamp = optarg;
 				break;
+			case 'u':
+				opts->socket = optarg;
+				break;
 			case 'V':
 				opts->version = 1;
+				break;
+			case 'w':
+				opts->archive = optarg;
+				break;
+			case 'x':
+				opts->metrics = optarg;
+				break;
 		}
 	}
 }
@@ -175,6 +684,225 @@ empty(char const *str)
 	return str == NULL || str[0] == '\0';
 }
 
+/*
+ * Allocates size bytes for the arena's buffer.
+ * Returns 0 on success, -1 on error (out of memory).
+ */
+static int
+arena_init(arena_s *arena, size_t size)
+{
+	arena->buf = malloc(size);
+	arena->size = arena->buf ? size : 0;
+	arena->used = 0;
+	return arena->buf ? 0 : -1;
+}
+
+/*
+ * Hands out n bytes (rounded up to a multiple of 16) from the arena. They 
+ * remain valid until the next reset. Returns NULL if the arena is exhausted.
+ */
+static void*
+arena_alloc(arena_s *arena, size_t n)
+{
+	n = (n + 15) & ~(size_t) 15;
+	if (arena->used + n > arena->size)
+	{
+		return NULL;
+	}
+	void *ptr = arena->buf + arena->used;
+	arena->used += n;
+	return ptr;
+}
+
+/*
+ * Takes back everything handed out by the arena so far.
+ */
+static void
+arena_reset(arena_s *arena)
+{
+	arena->used = 0;
+}
+
+static void
+arena_free(arena_s *arena)
+{
+	free(arena->buf);
+	arena->buf = NULL;
+	arena->size = 0;
+}
+
+/*
+ * Appends n bytes of str to sb, if they fit. Returns 0 on success, -1 if 
+ * there wasn't enough space left, in which case nothing is appended.
+ */
+static int
+sb_append(strbuf_s *sb, char const *str, size_t n)
+{
+	if (sb->len + n > sb->size)
+	{
+		return -1;
+	}
+	memcpy(sb->buf + sb->len, str, n);
+	sb->len += n;
+	return 0;
+}
+
+/*
+ * Appends str to sb, escaping it for use in a JSON string if json is set or
+ * replacing tabs and line breaks with spaces otherwise. Stops early if the
+ * escaped string doesn't fit, in which case it will be truncated.
+ */
+static void
+sb_escape(strbuf_s *sb, char const *str, int json)
+{
+	char esc[8];
+	for (; str && *str; ++str)
+	{
+		unsigned char c = *str;
+		int n = 1;
+		esc[0] = c;
+
+		if (json && (c == '"' || c == '\\'))
+		{
+			n = snprintf(esc, 8, "\\%c", c);
+		}
+		else if (json && c < 0x20)
+		{
+			n = snprintf(esc, 8, "\\u%04x", c);
+		}
+		else if (c == '\t' || c == '\n' || c == '\r')
+		{
+			esc[0] = ' ';
+		}
+
+		if (sb_append(sb, esc, n) == -1)
+		{
+			return;
+		}
+	}
+}
+
+/*
+ * Appends a formatted string to sb, if it fits. Returns 0 on success, -1 if 
+ * there wasn't enough space left, in which case nothing is appended.
+ */
+static int
+sb_printf(strbuf_s *sb, char const *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int n = vsnprintf(sb->buf + sb->len, sb->size - sb->len, format, ap);
+	va_end(ap);
+
+	if (n < 0 || (size_t) n >= sb->size - sb->len)
+	{
+		return -1;
+	}
+	sb->len += n;
+	return 0;
+}
+
+/*
+ * Returns the calling thread's block of metrics. Every thread only ever 
+ * writes to its own block, so counters don't need locks or atomic read-
+ * modify-write operations; blocks only get summed up when scraped.
+ */
+static metrics_s*
+metrics_local()
+{
+	static _Thread_local metrics_s *mine;
+	if (mine == NULL)
+	{
+		int i = atomic_fetch_add_explicit(&metrics_threads, 1, memory_order_relaxed);
+		mine = &metrics_blocks[i < METRICS_MAX_THREADS ? i : METRICS_MAX_THREADS - 1];
+	}
+	return mine;
+}
+
+/*
+ * Adds n to a counter of the calling thread's block of metrics.
+ */
+static void
+counter_add(_Atomic uint64_t *counter, uint64_t n)
+{
+	uint64_t v = atomic_load_explicit(counter, memory_order_relaxed);
+	atomic_store_explicit(counter, v + n, memory_order_relaxed);
+}
+
+/*
+ * Records a duration (ns) in a histogram of the calling thread's metrics.
+ */
+static void
+histogram_observe(histogram_s *hist, uint64_t ns)
+{
+	size_t b = 0;
+	for (; b < METRICS_BUCKETS && ns > metrics_bounds[b]; ++b);
+	counter_add(&hist->buckets[b], 1);
+	counter_add(&hist->sum, ns);
+}
+
+/*
+ * Returns a monotonic timestamp in nanoseconds, for measuring durations.
+ */
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Like fprintf() to stdout, but counts the bytes for the metrics.
+ */
+static int
+out_printf(char const *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int n = vfprintf(stdout, format, ap);
+	va_end(ap);
+
+	if (n > 0)
+	{
+		counter_add(&metrics_local()->bytes, n);
+	}
+	return n;
+}
+
+/*
+ * Like fwrite() to stdout, but counts the bytes for the metrics.
+ */
+static void
+out_write(char const *buf, size_t len)
+{
+	if (fwrite(buf, len, 1, stdout) == 1)
+	{
+		counter_add(&metrics_local()->bytes, len);
+	}
+}
+
+/*
+ * Removes the socket at path left over from an earlier run, if any. Returns 0
+ * if path is free to bind to, -1 if it isn't (errno set; EEXIST if there's 
+ * something other than a socket).
+ */
+static int
+unlink_socket(char const *path)
+{
+	struct stat st;
+	if (lstat(path, &st) == -1)
+	{
+		return errno == ENOENT ? 0 : -1;
+	}
+	if (!S_ISSOCK(st.st_mode))
+	{
+		errno = EEXIST;
+		return -1;
+	}
+	return unlink(path);
+}
+
 /**
  * Tries to determine the current size of the terminal window and returns them.
  * If a dimension can't be determined, width and/or height will be set to 0.
@@ -235,9 +963,12 @@ timestamp_str(char const *format, int timestamp, char *buf, size_t len)
 		return buf;
 	}
 
-	// Let's get the current time for a nice timestamp
+	// Let's get the current time for a nice timestamp; unlike localtime(),
+	// localtime_r() doesn't check for time zone changes (and allocate) on 
+	// every call, which is why main() calls tzset() once up front
 	time_t t = timestamp ? timestamp : time(NULL);
-	struct tm lt = *localtime(&t);
+	struct tm lt;
+	localtime_r(&t, &lt);
 
 	// Let's run the time through strftime() for format
 	strftime(buf, len, format, &lt);
@@ -293,59 +1024,11 @@ random_color(rgb_s *rgb)
 	return rgb;
 }
 
-/*
- * Called once the connection has been established. This does not mean we're
- * authenticated yet, hence we should not attempt to join channels yet etc.
- */
-static void
-handle_connect(twirc_state_t *s, twirc_event_t *evt)
-{
-	fputs("*** Connected\n", stdout);
-}
-
-/*
- * Called once we're authenticated. This is where we can join channels etc.
- */
-static void
-handle_welcome(twirc_state_t *s, twirc_event_t *evt)
+static char*
+color_prefix(int colormode, const rgb_s *rgb, char *buf, size_t len)
 {
-	options_s *opts = twirc_get_context(s);
-	fputs("*** Authenticated\n", stdout);
-
-	// Let's join the specified channel
-	twirc_cmd_join(s, opts->chan);
-}
-
-/*
- * Called once we see a user join a channel we're in. This also fires for when
- * we join a channel, in which case 'evt->origin' will be our own username.
- */
-static void
-handle_join(twirc_state_t *s, twirc_event_t *evt)
-{
-	twirc_login_t *login = twirc_get_login(s);
-
-	if (!evt->origin)
-	{
-		return;
-	}
-	if (!login->nick)
-	{
-		return;
-	}
-	if (strcmp(evt->origin, login->nick) != 0)
-	{
-		return;
-	}
-
-	fprintf(stdout, "*** Joined %s\n", evt->channel);
-}
-
-static char*
-color_prefix(int colormode, const rgb_s *rgb, char *buf, size_t len)
-{
-	// Initialize to empty string
-	buf[0] = '\0';
+	// Initialize to empty string
+	buf[0] = '\0';
 
 	if (colormode == COLOR_MODE_NONE || rgb == NULL)
 	{
@@ -466,7 +1149,7 @@ print_msg_head(char const *ts, char const *badges, char const *nick, int cmode,
 	//                        | | |  | .-- color end
 	//                        | | | /| | .-- ": "
 	//                        | | | || | | 
-	int p = fprintf(stdout, "%s%s%s%*s%s%s",
+	int p = out_printf("%s%s%s%*s%s%s",
 			ts,
 			empty(ts) ? "" : " ",
 			col_prefix,
@@ -491,11 +1174,11 @@ print_msg_body(char *msg, int cmode, char const *hex, size_t tw, int pad)
 
 	if (tw == 0)
 	{
-		return fprintf(stdout, "%s%s%s\n", col_prefix, msg, col_suffix);
+		return out_printf("%s%s%s\n", col_prefix, msg, col_suffix);
 	}
 
 	// If this is an action message ("/me", cmode will be != 0), we color it 
-	fprintf(stdout, "%s", col_prefix);
+	out_printf("%s", col_prefix);
 
 	// TODO this smells, I feel like we can do this with a third of the code
 	// TODO it also doesn't work, lul
@@ -517,7 +1200,7 @@ print_msg_body(char *msg, int cmode, char const *hex, size_t tw, int pad)
 			// ...we just print it and fuck up alignment
 			// TODO obviously, we should instead just split
 			// the word up, print the remainder on the next line
-			fputs(tok, stdout);
+			out_printf("%s", tok);
 			w++;
 		}
 
@@ -525,7 +1208,7 @@ print_msg_body(char *msg, int cmode, char const *hex, size_t tw, int pad)
 		else if (tok_len <= width_left)
 		{
 			// ...we print it, maybe with a space before it
-			fprintf(stdout, "%s%s", w > 0 ? " " : "", tok);
+			out_printf("%s%s", w > 0 ? " " : "", tok);
 			width_left -= tok_len + (w > 0);
 			w++;
 		}	
@@ -534,17 +1217,17 @@ print_msg_body(char *msg, int cmode, char const *hex, size_t tw, int pad)
 		else
 		{
 			// ...so we need a line break and padding
-			fputc('\n', stdout);
+			out_write("\n", 1);
 			// And now reset the available width size
 			width_left = width;
-			fprintf(stdout, "%*s%s", pad, "", tok);
+			out_printf("%*s%s", pad, "", tok);
 			width_left = width - tok_len;
 			w++;
 		}
 	}
 
 	// Finally, add the last line break (and end the color code)
-	fprintf(stdout, "%s\n", col_suffix);
+	out_printf("%s\n", col_suffix);
 
 	return 0;
 }
@@ -577,232 +1260,3425 @@ print_action_aligned(char const *ts, char const *badges, char const *nick, char
 	print_msg_body(msg, cmode, hex, tw, pad);	
 }
 
+/*
+ * Prints a chat message, picking the right print function based on options.
+ * The timestamp ts is in seconds, 0 meaning the current time. The message
+ * will be modified in the process, hence it can not be a string literal.
+ * Scratch buffers are taken from arena.
+ */
 static void
-handle_message(twirc_state_t *s, twirc_event_t *evt)
+print_message(options_s *opts, arena_s *arena, int ts, char const *badges, char const *nick, char *msg, int action, char const *color)
 {
-	options_s *opts = twirc_get_context(s);
-
-	char const *color  = twirc_get_tag_value(evt->tags, "color");
-	char const *badges = twirc_get_tag_value(evt->tags, "badges");
-	char const *dname  = twirc_get_tag_value(evt->tags, "display-name");
-	char const *tmits  = twirc_get_tag_value(evt->tags, "tmi-sent-ts");
+	char *badge = arena_alloc(arena, 2);
+	char *hex = arena_alloc(arena, 8);
+	char *timestamp = arena_alloc(arena, TIMESTAMP_BUFFER);
 
-	// Prepare nickname string
-	char nick[TWIRC_NICK_SIZE];
-	snprintf(nick, TWIRC_NICK_SIZE, "%s", opts->displaynames && !empty(dname) ? dname : evt->origin);
+	if (badge == NULL || hex == NULL || timestamp == NULL)
+	{
+		return;
+	}
 
 	// Prepare badges string
-	char badge[2];
 	snprintf(badge, 2, "%s", is_mod(badges) == 1 ? "@" : (is_sub(badges) == 1 ? "+" : ""));
 
 	// Prepare color string
-	char hex[8];
-       	snprintf(hex, 8, "%s", empty(color) ? "#FFFFFF" : color);
+	snprintf(hex, 8, "%s", empty(color) ? "#FFFFFF" : color);
 
 	// Prepare timestamp string
-	char timestamp[TIMESTAMP_BUFFER];
-	int ts = opts->twitchtime ? atoi(tmits)/1000 : 0;
 	timestamp_str(opts->timestamp, ts, timestamp, TIMESTAMP_BUFFER);
 
-	if (evt->ctcp)
+	if (action)
 	{
 		if (opts->align)
 		{
-			print_action_aligned(timestamp, badge, nick, evt->message, opts->colormode, hex, opts->term_width);
+			print_action_aligned(timestamp, badge, nick, msg, opts->colormode, hex, opts->term_width);
 		}
 		else
 		{
-			print_action(timestamp, badge, nick, evt->message, opts->colormode, hex);
+			print_action(timestamp, badge, nick, msg, opts->colormode, hex);
 		}
 	}
 	else
 	{
 		if (opts->align)
 		{
-			print_privmsg_aligned(timestamp, badge, nick, evt->message, opts->colormode, hex, opts->term_width);
+			print_privmsg_aligned(timestamp, badge, nick, msg, opts->colormode, hex, opts->term_width);
 		}
 		else
 		{
-			print_privmsg(timestamp, badge, nick, evt->message, opts->colormode, hex);
+			print_privmsg(timestamp, badge, nick, msg, opts->colormode, hex);
 		}
 
 	}
 }
 
 /*
- * Called when a loss of connection has been detected. This could be due to 
- * a connection error or because Twitch closed the connection on us.
+ * Render plans
+ *
+ * A user-defined format string (-f) gets compiled into a render plan once at
+ * startup: a flat list of ops, each appending a literal or a message field 
+ * to the output line. Everything that can be decided up front, like the color
+ * mode or whether to use display names, is baked into the op types, so that
+ * rendering a message only means walking the list once.
  */
-static void
-handle_disconnect(twirc_state_t *s, twirc_event_t *evt)
+
+/*
+ * Adds an op to the plan. Returns 0 on success, -1 if the plan is full.
+ */
+static int
+render_plan_add(render_plan_s *plan, uint8_t type, uint8_t action, char const *str, size_t len)
 {
-	fputs("*** Disconnected\n", stdout);
-	running = 0;
+	if (plan->count == RENDER_MAX_OPS)
+	{
+		return -1;
+	}
+	render_op_s *op = &plan->ops[plan->count++];
+	op->type = type;
+	op->action = action;
+	op->str = str;
+	op->len = len;
+	return 0;
 }
 
 /*
- * Handle signals. 
+ * Returns the op type that sets the color for the given color mode, or 0
+ * if no color should be used at all.
  */
-static void
-on_signal(int sig)
+static uint8_t
+render_color_op(int colormode)
 {
-	switch (sig)
+	switch (colormode)
 	{
-		case SIGWINCH:
-			resized = 1;
-			break;
-		case SIGINT:
-		case SIGTERM:
-		case SIGQUIT:
-			running = 0;
-			break;
+		case COLOR_MODE_2BIT:
+			return RENDER_COLOR_2BIT;
+		case COLOR_MODE_4BIT:
+			return RENDER_COLOR_4BIT;
+		case COLOR_MODE_8BIT:
+			return RENDER_COLOR_8BIT;
+		case COLOR_MODE_TRUE:
+			return RENDER_COLOR_TRUE;
+		default:
+			return 0;
 	}
 }
 
-/**
- * Prints the program's name and version number.
+/*
+ * Compiles the format string into plan, based on the given options. The 
+ * format string needs to outlive the plan, as literals point into it.
+ * Returns 0 on success, -1 on error (unknown field, format too long).
  */
-static void
-version()
+static int
+render_plan_compile(render_plan_s *plan, char const *format, options_s const *opts)
 {
-	fprintf(stdout, "%s %d.%d.%d\n%s\n",
-			PROJECT_NAME,
-			VERSION_MAJOR,
-		       	VERSION_MINOR,
-			VERSION_PATCH,
-			PROJECT_URL);
+	memset(plan, 0, sizeof(render_plan_s));
+	plan->timestamp = opts->timestamp ? opts->timestamp : DEFAULT_TIMESTAMP;
+
+	uint8_t color = render_color_op(opts->colormode);
+	int err = 0;
+
+	for (char const *c = format; *c && !err; ++c)
+	{
+		// Literal up to the next field (or the end)
+		if (*c != '%')
+		{
+			size_t len = strcspn(c, "%");
+			err |= render_plan_add(plan, RENDER_LITERAL, 0, c, len);
+			c += len - 1;
+			continue;
+		}
+
+		switch (*++c)
+		{
+			case '%':
+				err |= render_plan_add(plan, RENDER_LITERAL, 0, c, 1);
+				break;
+			case 't':
+				err |= render_plan_add(plan, RENDER_TIMESTAMP, 0, NULL, 0);
+				break;
+			case 'b':
+				err |= render_plan_add(plan, RENDER_BADGE, 0, NULL, 0);
+				break;
+			case 'c':
+				err |= render_plan_add(plan, RENDER_CHAN, 0, NULL, 0);
+				break;
+			case 'i':
+				err |= render_plan_add(plan, RENDER_ID, 0, NULL, 0);
+				break;
+			case 'n':
+				// Nicks are always colored
+				err |= color && render_plan_add(plan, color, 0, NULL, 0);
+				err |= render_plan_add(plan, opts->displaynames ? RENDER_DNAME : RENDER_NICK, 0, NULL, 0);
+				err |= color && render_plan_add(plan, RENDER_COLOR_RESET, 0, NULL, 0);
+				break;
+			case 'm':
+				// Messages only for actions ("/me")
+				err |= color && render_plan_add(plan, color, 1, NULL, 0);
+				err |= render_plan_add(plan, RENDER_TEXT, 0, NULL, 0);
+				err |= color && render_plan_add(plan, RENDER_COLOR_RESET, 1, NULL, 0);
+				break;
+			default:
+				// Unknown field or '%' at the end of the string
+				return -1;
+		}
+	}
+
+	return err ? -1 : 0;
 }
 
-/**
- * Prints usage information.
+/*
+ * Renders the message according to plan and writes it to stdout in one go.
+ * The timestamp ts is in seconds, 0 meaning the current time. The line is
+ * assembled in a buffer taken from arena.
  */
 static void
-help(char *invocation, FILE *where)
+render_plan_print(render_plan_s const *plan, arena_s *arena, int ts, message_s const *m)
 {
-	fprintf(where, "Usage:\n");
-	fprintf(where, "\t%s -c CHANNEL [OPTIONS...]\n", invocation);
-	fprintf(where, "\tNote: the channel should start with '#' and be all lower-case.\n");
-	fprintf(where, "\n");
-	fprintf(where, "Options:\n");
-	fprintf(where, "\t-a Neatly align (left-pad) usernames and messages.\n");
-	fprintf(where, "\t-b Mark subscribers and mods with + and @ respectively.\n");
-	fprintf(where, "\t-d Use display names instead of user names where available.\n");
-	fprintf(where, "\t-h Print this help text and exit.\n");
-	fprintf(where, "\t-m MODE Set the color mode: 'true', '8bit', '4bit', '2bit' or 'mono'.\n");
-	fprintf(where, "\t-r Use the server-supplied timestamp instead of the local time.\n");
-	fprintf(where, "\t-s Print additional status information to stderr.\n");
-	fprintf(where, "\t-t FORMAT Enable timestamps, using the specified format.\n");
-	fprintf(where, "\t-V Print version information and exit.\n");
+	char *line = arena_alloc(arena, RENDER_BUFFER);
+	char *tmp = arena_alloc(arena, RENDER_TMP_BUFFER);
+	if (line == NULL || tmp == NULL)
+	{
+		return;
+	}
+
+	strbuf_s sb = { .buf = line, .size = RENDER_BUFFER - 1 };
+	rgb_s rgb;
+
+	for (size_t i = 0; i < plan->count; ++i)
+	{
+		render_op_s const *op = &plan->ops[i];
+		char const *str = NULL;
+		int len = -1;
+
+		if (op->action && !m->action)
+		{
+			continue;
+		}
+
+		switch (op->type)
+		{
+			case RENDER_LITERAL:
+				str = op->str;
+				len = op->len;
+				break;
+			case RENDER_TIMESTAMP:
+				str = timestamp_str(plan->timestamp, ts, tmp, TIMESTAMP_BUFFER);
+				break;
+			case RENDER_BADGE:
+				str = is_mod(m->badges) == 1 ? "@" : (is_sub(m->badges) == 1 ? "+" : "");
+				break;
+			case RENDER_NICK:
+				str = m->nick;
+				break;
+			case RENDER_DNAME:
+				str = empty(m->dname) ? m->nick : m->dname;
+				break;
+			case RENDER_TEXT:
+				str = m->text;
+				break;
+			case RENDER_CHAN:
+				str = m->chan;
+				break;
+			case RENDER_ID:
+				str = m->id;
+				break;
+			case RENDER_COLOR_2BIT:
+				rgb = hex_to_rgb(empty(m->color) ? "#FFFFFF" : m->color);
+				len = rgb_to_4bit(&rgb);
+				len = snprintf(tmp, RENDER_TMP_BUFFER, "\033[%dm", len >= 90 ? len-60 : len);
+				str = tmp;
+				break;
+			case RENDER_COLOR_4BIT:
+				rgb = hex_to_rgb(empty(m->color) ? "#FFFFFF" : m->color);
+				len = snprintf(tmp, RENDER_TMP_BUFFER, "\033[%dm", rgb_to_4bit(&rgb));
+				str = tmp;
+				break;
+			case RENDER_COLOR_8BIT:
+				rgb = hex_to_rgb(empty(m->color) ? "#FFFFFF" : m->color);
+				len = snprintf(tmp, RENDER_TMP_BUFFER, "\033[38;5;%dm", rgb_to_8bit(&rgb));
+				str = tmp;
+				break;
+			case RENDER_COLOR_TRUE:
+				rgb = hex_to_rgb(empty(m->color) ? "#FFFFFF" : m->color);
+				len = snprintf(tmp, RENDER_TMP_BUFFER, "\033[38;2;%d;%d;%dm", rgb.r, rgb.g, rgb.b);
+				str = tmp;
+				break;
+			case RENDER_COLOR_RESET:
+				str = ANSI_FONT_RESET;
+				break;
+		}
+
+		if (str)
+		{
+			// Truncate rather than drop what doesn't fit
+			size_t n = len == -1 ? strlen(str) : (size_t) len;
+			sb_append(&sb, str, n > sb.size - sb.len ? sb.size - sb.len : n);
+		}
+	}
+
+	// We've left room for the line break
+	line[sb.len++] = '\n';
+	out_write(line, sb.len);
 }
 
 /*
- * Tries to determine the terminal's color capabilities by looking at the 
- * TERM and COLORTERM environment variables and, based on this, returns an
- * educated guess as to which is the highest supported color mode. In case
- * no hints to the color mode can be found in either variable, this function
- * errors on the safe side and returns COLOR_MODE_MONO.
+ * Archive
+ *
+ * An archive starts with a header of ARCHIVE_HEAD_SIZE bytes (magic, block 
+ * size), followed by any number of blocks of ARCHIVE_BLOCK_SIZE bytes each.
+ * Every block starts with the timestamp of its first record, the number of 
+ * records and the number of bytes used, followed by the records themselves.
+ * Records never span blocks, unused space at the end of a block is zeroed.
+ *
+ * A record consists of varints (LEB128) only, except for the message id and 
+ * the message text itself:
+ *
+ *   time delta to the previous record in the block (ms)
+ *   flags (ARCHIVE_FLAG_*)
+ *   dictionary ids of nick, display name, color and badges (0 = none)
+ *   dictionary id of the channel (only if ARCHIVE_FLAG_CHAN is set)
+ *   message id (16 bytes, only if ARCHIVE_FLAG_ID is set)
+ *   message length, followed by the message bytes
+ *
+ * Tombstones (ARCHIVE_FLAG_TOMBSTONE) use the same layout, with an empty
+ * message: they delete the message with the given id or, without an id, all
+ * messages by the given nick or, without a nick, all messages before them.
+ * Notices (ARCHIVE_FLAG_NOTICE) do too, with Twitch's description of the sub,
+ * raid or change of the chat settings as their message.
+ *
+ * Whenever a string gets added to the dictionary, a definition record 
+ * (ARCHIVE_FLAG_DICT) precedes the first record that refers to it. It only 
+ * consists of the time delta (0), the flags and the string's length and bytes;
+ * the strings get ids 1, 2, 3, ... in the order of their definitions.
+ *
+ * After the last block comes the dictionary (number of strings, then length
+ * and bytes of every string), then the sparse time index (first timestamp of
+ * every block, 8 bytes each) and finally the footer (magic, dictionary offset,
+ * index offset). All fixed-width integers are little endian. As the index and
+ * the blocks are sorted by time, a reader can mmap() the file and jump to any
+ * point in time with a binary search over the index.
+ *
+ * Dictionary, index and footer are only written when the archive is closed.
+ * If the writer didn't get to do that, the blocks written up to that point 
+ * can still be read front to back, collecting the definition records first.
  */
-static uint8_t
-detect_color_mode()
+
+static void
+put_u64(unsigned char *buf, uint64_t v)
 {
-	// Don't output colors if we're not talking to a terminal
-	if (!isatty(fileno(stdout)))
+	for (int i = 0; i < 8; ++i)
 	{
-		return COLOR_MODE_MONO; 
+		buf[i] = (v >> (i * 8)) & 0xFF;
 	}
+}
 
-	// Check terminal name for suffix '-m' or '-256'
-	char *term  = getenv("TERM");
-	if (term && strstr(term, "-m\0"))
-	{
-		// -m = Monochrome, no colors
-		return COLOR_MODE_MONO;
-	}
-	if (term && strstr(term, "-m-"))
+static uint64_t
+get_u64(unsigned char const *buf)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < 8; ++i)
 	{
-		return COLOR_MODE_MONO;
+		v |= (uint64_t) buf[i] << (i * 8);
 	}
-	if (term && strstr(term, "-8c"))
+	return v;
+}
+
+/*
+ * Writes v as varint to buf, which needs to hold at least 10 bytes.
+ * Returns the number of bytes written.
+ */
+static size_t
+put_varint(unsigned char *buf, uint64_t v)
+{
+	size_t n = 0;
+	for (; v >= 0x80; v >>= 7)
 	{
-		return COLOR_MODE_2BIT;
+		buf[n++] = (v & 0x7F) | 0x80;
 	}
-	if (term && strstr(term, "-16c"))
+	buf[n++] = v;
+	return n;
+}
+
+/*
+ * Reads a varint from *buf into v and advances *buf accordingly.
+ * Returns 0 on success, -1 if the varint would extend beyond end.
+ */
+static int
+get_varint(unsigned char const **buf, unsigned char const *end, uint64_t *v)
+{
+	*v = 0;
+	for (int shift = 0; *buf < end && shift < 64; shift += 7)
 	{
-		return COLOR_MODE_4BIT;
+		unsigned char b = *(*buf)++;
+		*v |= (uint64_t) (b & 0x7F) << shift;
+		if (!(b & 0x80))
+		{
+			return 0;
+		}
 	}
-	if (term && strstr(term, "-256"))
+	return -1;
+}
+
+/*
+ * Returns the current time in milliseconds since the epoch.
+ */
+static uint64_t
+now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * FNV-1a hash of the given string.
+ */
+static uint32_t
+fnv1a(char const *str)
+{
+	uint32_t h = 2166136261u;
+	for (; *str; ++str)
 	{
-		return COLOR_MODE_8BIT;
+		h = (h ^ (unsigned char) *str) * 16777619u;
 	}
+	return h;
+}
 
-	// Check COLORTERM env var for 'truecolor' or '24bit'
-	// https://gist.github.com/XVilka/8346728
-	char *cterm = getenv("COLORTERM");
-	if (cterm && strstr(cterm, "truecolor"))
+/*
+ * Grows the dictionary to hold size strings and pool_size bytes of them, 
+ * rehashing all strings if need be. Returns 0 on success, -1 on error (out 
+ * of memory).
+ */
+static int
+dict_grow(archive_dict_s *dict, uint32_t size, size_t pool_size)
+{
+	if (pool_size > dict->pool_size)
 	{
-		return COLOR_MODE_TRUE;
+		char *pool = realloc(dict->pool, pool_size);
+		if (pool == NULL)
+		{
+			return -1;
+		}
+		dict->pool = pool;
+		dict->pool_size = pool_size;
 	}
-	if (cterm && strstr(cterm, "24bit"))
+
+	if (size > dict->size)
 	{
-		return COLOR_MODE_TRUE;
+		uint32_t *offs = realloc(dict->offs, size * sizeof(uint32_t));
+		if (offs == NULL)
+		{
+			return -1;
+		}
+		dict->offs = offs;
+
+		// The hash table has room for twice the strings, so it's never full
+		uint32_t *slots = calloc((size_t) size * 2, sizeof(uint32_t));
+		if (slots == NULL)
+		{
+			return -1;
+		}
+		uint32_t mask = size * 2 - 1;
+		for (uint32_t id = 1; id <= dict->count; ++id)
+		{
+			uint32_t s = fnv1a(dict->pool + dict->offs[id - 1]) & mask;
+			for (; slots[s]; s = (s + 1) & mask);
+			slots[s] = id;
+		}
+		free(dict->slots);
+		dict->slots = slots;
+		dict->size = size;
 	}
+	return 0;
+}
 
-	return COLOR_MODE_MONO;
+/*
+ * Reserves the initial memory for the dictionary, so that adding strings 
+ * doesn't need to allocate anything. Returns 0 on success, -1 on error.
+ */
+static int
+dict_init(archive_dict_s *dict)
+{
+	memset(dict, 0, sizeof(archive_dict_s));
+	return dict_grow(dict, ARCHIVE_DICT_STRINGS, ARCHIVE_DICT_POOL);
 }
 
 /*
- * Main - this is where we make things happen!
+ * Grows the dictionary if less than half of its initial capacity is left.
+ * This allocates, see archive_reserve(). Returns 0 on success, -1 on error.
  */
-int
-main(int argc, char **argv)
+static int
+dict_reserve(archive_dict_s *dict)
 {
-	// Parse command line arguments
-	options_s opts = { 0 };
-	parse_args(argc, argv, &opts);
+	uint32_t size = dict->size;
+	size_t pool_size = dict->pool_size;
 
-	if (opts.help)
+	if (size - dict->count < ARCHIVE_DICT_STRINGS / 2)
 	{
-		help(argv[0], stdout);
-		return EXIT_SUCCESS;
+		size *= 2;
 	}
+	if (pool_size - dict->pool_used < ARCHIVE_DICT_POOL / 2)
+	{
+		pool_size *= 2;
+	}
+	return dict_grow(dict, size, pool_size);
+}
 
-	if (opts.version)
+/*
+ * Returns the id of str in the dictionary, adding it if it isn't in there 
+ * yet. Ids are shifted by one, so that 0 can be returned for NULL or empty
+ * strings, as well as for strings that are too long to be worth it. 
+ * Returns -1 on error (out of memory).
+ */
+static int64_t
+dict_id(archive_dict_s *dict, char const *str)
+{
+	size_t len = empty(str) ? 0 : strlen(str);
+	if (len == 0 || len > ARCHIVE_DICT_MAX_LEN)
 	{
-		version();
-		return EXIT_SUCCESS;
+		return 0;
 	}
-	
-	// Abort if no channel name was given	
-	if (opts.chan == NULL)
+
+	// dict_reserve() should have made room already
+	if ((dict->count == dict->size || dict->pool_used + len + 1 > dict->pool_size) &&
+			dict_grow(dict, dict->size * 2, dict->pool_size * 2) == -1)
 	{
-		help(argv[0], stderr);
-		return EXIT_FAILURE;
+		return -1;
+	}
+
+	uint32_t mask = dict->size * 2 - 1;
+	uint32_t s = fnv1a(str) & mask;
+	for (; dict->slots[s]; s = (s + 1) & mask)
+	{
+		if (strcmp(dict->pool + dict->offs[dict->slots[s] - 1], str) == 0)
+		{
+			return dict->slots[s];
+		}
+	}
+
+	memcpy(dict->pool + dict->pool_used, str, len + 1);
+	dict->offs[dict->count] = dict->pool_used;
+	dict->pool_used += len + 1;
+	dict->slots[s] = ++dict->count;
+	return dict->count;
+}
+
+static void
+dict_free(archive_dict_s *dict)
+{
+	free(dict->offs);
+	free(dict->slots);
+	free(dict->pool);
+}
+
+/*
+ * Parses a message id (UUID, "xxxxxxxx-xxxx-...") into 16 bytes.
+ * Returns 0 on success, -1 if id is not a valid UUID.
+ */
+static int
+uuid_parse(char const *id, unsigned char *buf)
+{
+	if (empty(id))
+	{
+		return -1;
+	}
+
+	int n = 0;
+	for (; *id && n < 32; ++id)
+	{
+		int nibble;
+		if      (*id >= '0' && *id <= '9') nibble = *id - '0';
+		else if (*id >= 'a' && *id <= 'f') nibble = *id - 'a' + 10;
+		else if (*id >= 'A' && *id <= 'F') nibble = *id - 'A' + 10;
+		else if (*id == '-') continue;
+		else return -1;
+
+		buf[n / 2] = (n % 2) ? (buf[n / 2] | nibble) : (nibble << 4);
+		++n;
+	}
+	return (n == 32 && *id == '\0') ? 0 : -1;
+}
+
+/*
+ * Formats 16 bytes as message id (UUID) into buf of size UUID_BUFFER.
+ */
+static void
+uuid_format(unsigned char const *uuid, char *buf)
+{
+	snprintf(buf, UUID_BUFFER, 
+			"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+			uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6], uuid[7],
+			uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+}
+
+/*
+ * Creates (or truncates) the archive file at path and writes its header.
+ * Returns the archive or NULL on error.
+ */
+static archive_s*
+archive_open(char const *path)
+{
+	archive_s *arc = calloc(1, sizeof(archive_s));
+	if (arc == NULL)
+	{
+		return NULL;
+	}
+
+	arc->index_size = ARCHIVE_INDEX_SIZE;
+	arc->index = malloc(ARCHIVE_INDEX_SIZE * sizeof(uint64_t));
+
+	if (arc->index == NULL || dict_init(&arc->dict) == -1 || 
+			(arc->fp = fopen(path, "wb")) == NULL)
+	{
+		dict_free(&arc->dict);
+		free(arc->index);
+		free(arc);
+		return NULL;
+	}
+
+	unsigned char head[ARCHIVE_HEAD_SIZE] = { 0 };
+	memcpy(head, ARCHIVE_MAGIC, 8);
+	head[8] = ARCHIVE_BLOCK_SIZE & 0xFF;
+	head[9] = (ARCHIVE_BLOCK_SIZE >> 8) & 0xFF;
+
+	if (fwrite(head, ARCHIVE_HEAD_SIZE, 1, arc->fp) != 1)
+	{
+		fclose(arc->fp);
+		dict_free(&arc->dict);
+		free(arc->index);
+		free(arc);
+		return NULL;
+	}
+
+	arc->used = ARCHIVE_BLOCK_HEAD;
+	return arc;
+}
+
+/*
+ * Grows the index and the dictionary if less than half of their initial 
+ * capacity is left. This allocates, so it should be called regularly outside
+ * of processing messages, for example after every twirc_tick(). Returns 0 on
+ * success, -1 on error.
+ */
+static int
+archive_reserve(archive_s *arc)
+{
+	if (dict_reserve(&arc->dict) == -1)
+	{
+		return -1;
+	}
+	if (arc->index_size - arc->blocks >= ARCHIVE_INDEX_SIZE / 2)
+	{
+		return 0;
+	}
+
+	size_t size = arc->index_size * 2;
+	uint64_t *index = realloc(arc->index, size * sizeof(uint64_t));
+	if (index == NULL)
+	{
+		return -1;
+	}
+	arc->index = index;
+	arc->index_size = size;
+	return 0;
+}
+
+/*
+ * Writes the current block to the archive file and adds it to the index.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+archive_flush(archive_s *arc)
+{
+	if (arc->records == 0)
+	{
+		return 0;
+	}
+
+	// archive_reserve() should have made room already
+	if (arc->blocks == arc->index_size && archive_reserve(arc) == -1)
+	{
+		return -1;
+	}
+
+	put_u64(arc->block, arc->first_ts);
+	arc->block[8]  = arc->records & 0xFF;
+	arc->block[9]  = arc->records >> 8;
+	arc->block[10] = arc->used & 0xFF;
+	arc->block[11] = arc->used >> 8;
+	memset(arc->block + arc->used, 0, ARCHIVE_BLOCK_SIZE - arc->used);
+
+	if (fwrite(arc->block, ARCHIVE_BLOCK_SIZE, 1, arc->fp) != 1)
+	{
+		return -1;
+	}
+
+	arc->index[arc->blocks++] = arc->first_ts;
+	arc->records = 0;
+	arc->used = ARCHIVE_BLOCK_HEAD;
+	return 0;
+}
+
+/*
+ * Appends the record rec of length len (without the leading time delta) with
+ * the timestamp ts, starting a new block if it doesn't fit into the current
+ * one. Returns 0 on success, -1 on error.
+ */
+static int
+archive_append(archive_s *arc, uint64_t ts, unsigned char const *rec, size_t len)
+{
+	if (arc->used + 10 + len > ARCHIVE_BLOCK_SIZE && archive_flush(arc) == -1)
+	{
+		return -1;
+	}
+	if (arc->records == 0)
+	{
+		arc->first_ts = ts;
+		arc->last_ts = ts;
+	}
+
+	arc->used += put_varint(arc->block + arc->used, ts - arc->last_ts);
+	memcpy(arc->block + arc->used, rec, len);
+	arc->used += len;
+	arc->records++;
+	arc->last_ts = ts;
+	return 0;
+}
+
+/*
+ * Appends a message to the archive. Timestamps are clamped so that they 
+ * never decrease within an archive.
+ * Messages that would not fit into an empty block get truncated.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+archive_write(archive_s *arc, message_s const *m)
+{
+	unsigned char rec[ARCHIVE_BLOCK_SIZE];
+	size_t len = 0;
+
+	unsigned char uuid[16];
+	uint32_t known = arc->dict.count;
+	int flags = (m->action ? ARCHIVE_FLAG_ACTION : 0) | 
+		(m->tombstone ? ARCHIVE_FLAG_TOMBSTONE : 0) |
+		(m->notice ? ARCHIVE_FLAG_NOTICE : 0) |
+		(uuid_parse(m->id, uuid) == 0 ? ARCHIVE_FLAG_ID : 0);
+
+	int64_t ids[5] = {
+		dict_id(&arc->dict, m->nick),
+		dict_id(&arc->dict, m->dname),
+		dict_id(&arc->dict, m->color),
+		dict_id(&arc->dict, m->badges),
+		dict_id(&arc->dict, m->chan)
+	};
+	flags |= ids[4] ? ARCHIVE_FLAG_CHAN : 0;
+
+	uint64_t ts = m->ts < arc->last_ts ? arc->last_ts : m->ts;
+
+	// Define the strings that just got added to the dictionary
+	for (uint32_t i = known; i < arc->dict.count; ++i)
+	{
+		unsigned char def[ARCHIVE_DICT_MAX_LEN + 20];
+		char const *str = arc->dict.pool + arc->dict.offs[i];
+		size_t str_len = strlen(str);
+		size_t def_len = put_varint(def, ARCHIVE_FLAG_DICT);
+		def_len += put_varint(def + def_len, str_len);
+		memcpy(def + def_len, str, str_len);
+		if (archive_append(arc, ts, def, def_len + str_len) == -1)
+		{
+			return -1;
+		}
+	}
+
+	// A tombstone for a user that lost its nick would clear all messages
+	if (m->tombstone && !(flags & ARCHIVE_FLAG_ID) && !empty(m->nick) && ids[0] == 0)
+	{
+		return -1;
+	}
+
+	// Everything but the leading time delta goes into rec first
+	len += put_varint(rec + len, flags);
+	for (int i = 0; i < 4 + !!(flags & ARCHIVE_FLAG_CHAN); ++i)
+	{
+		if (ids[i] == -1)
+		{
+			return -1;
+		}
+		len += put_varint(rec + len, ids[i]);
+	}
+	if (flags & ARCHIVE_FLAG_ID)
+	{
+		memcpy(rec + len, uuid, 16);
+		len += 16;
+	}
+
+	//                         .-- block header
+	//                         |                    .-- time delta
+	//                         |                    |    .-- message length
+	//                         |                    |    |
+	size_t max = ARCHIVE_BLOCK_SIZE - ARCHIVE_BLOCK_HEAD - 10 - 10 - len;
+	size_t msg_len = strlen(m->text);
+	msg_len = msg_len > max ? max : msg_len;
+	len += put_varint(rec + len, msg_len);
+	memcpy(rec + len, m->text, msg_len);
+	len += msg_len;
+
+	return archive_append(arc, ts, rec, len);
+}
+
+/*
+ * Flushes the last block, writes dictionary, index and footer, closes the 
+ * file and frees the archive. Returns 0 on success, -1 on error.
+ */
+static int
+archive_close(archive_s *arc)
+{
+	int err = archive_flush(arc);
+	unsigned char buf[10];
+
+	// Dictionary
+	uint64_t dict_off = ARCHIVE_HEAD_SIZE + (uint64_t) arc->blocks * ARCHIVE_BLOCK_SIZE;
+	fwrite(buf, put_varint(buf, arc->dict.count), 1, arc->fp);
+	for (uint32_t i = 0; i < arc->dict.count; ++i)
+	{
+		char const *str = arc->dict.pool + arc->dict.offs[i];
+		size_t len = strlen(str);
+		fwrite(buf, put_varint(buf, len), 1, arc->fp);
+		fwrite(str, len, 1, arc->fp);
+	}
+
+	// Index
+	uint64_t index_off = ftell(arc->fp);
+	for (size_t i = 0; i < arc->blocks; ++i)
+	{
+		put_u64(buf, arc->index[i]);
+		fwrite(buf, 8, 1, arc->fp);
+	}
+
+	// Footer
+	unsigned char foot[ARCHIVE_FOOT_SIZE];
+	memcpy(foot, ARCHIVE_FOOT_MAGIC, 8);
+	put_u64(foot + 8, dict_off);
+	put_u64(foot + 16, index_off);
+	fwrite(foot, ARCHIVE_FOOT_SIZE, 1, arc->fp);
+
+	err |= ferror(arc->fp) ? -1 : 0;
+	err |= fclose(arc->fp);
+
+	dict_free(&arc->dict);
+	free(arc->index);
+	free(arc);
+	return err ? -1 : 0;
+}
+
+
+/*
+ * Fan-out server
+ *
+ * Serves all messages to any number of local clients via a Unix domain 
+ * socket. After connecting, a client sends a single subscription line of
+ * space-separated options, for example "format=json mods match=Kappa":
+ *
+ *   format=raw|tsv|json  how events are serialized (default: tsv)
+ *   nick=NAME            only messages by user NAME
+ *   match=TEXT           only messages containing TEXT
+ *   mods, subs, actions  only messages by mods, subs or actions ("/me")
+ *
+ * Every event is serialized once per format that has subscribers and stored
+ * in a ring buffer, from which all clients get served. Clients that fall 
+ * behind by more than the size of the ring buffer get dropped.
+ *
+ * Tombstones (see message_s) are sent to all clients, except those filtering
+ * by a different nick. As JSON, they only carry ts, chan, nick and id, plus
+ * "tombstone":true; as TSV, their type column (0 = message, 1 = action) is 2
+ * and their text is empty. Notices (see message_s) get filtered like messages;
+ * as JSON, they have "notice":true instead of "action", as TSV, type 3.
+ */
+
+/*
+ * Returns the fan-out format for the given name or -1 if there is none.
+ */
+static int
+fanout_format(char const *name)
+{
+	if (strcmp(name, "raw") == 0)
+	{
+		return FANOUT_FORMAT_RAW;
+	}
+	if (strcmp(name, "tsv") == 0)
+	{
+		return FANOUT_FORMAT_TSV;
+	}
+	if (strcmp(name, "json") == 0)
+	{
+		return FANOUT_FORMAT_JSON;
+	}
+	return -1;
+}
+
+/*
+ * Serializes the message into buf (of size FANOUT_SLOT_SIZE) according to 
+ * format. The result is always terminated by a line break; in case it would
+ * be too long, the message text gets truncated. Returns the length.
+ */
+static size_t
+fanout_serialize(message_s const *m, int format, char *buf)
+{
+	// Leave some room to end the record even if the text got truncated
+	strbuf_s sb = { .buf = buf, .size = FANOUT_SLOT_SIZE - 8 };
+	char num[24];
+
+	// Played back messages have no raw IRC message, skip them
+	if (format == FANOUT_FORMAT_RAW && m->raw == NULL)
+	{
+		return 0;
+	}
+	if (format == FANOUT_FORMAT_RAW)
+	{
+		sb_escape(&sb, m->raw, 0);
+		sb.size = FANOUT_SLOT_SIZE;
+		sb_append(&sb, "\n", 1);
+		return sb.len;
+	}
+
+	snprintf(num, 24, "%" PRIu64, m->ts);
+
+	if (format == FANOUT_FORMAT_TSV)
+	{
+		char const *fields[] = { 
+			num, m->chan, m->tombstone ? "2" : (m->notice ? "3" : (m->action ? "1" : "0")), 
+			m->badges, m->nick, m->dname, m->color, m->id, m->text 
+		};
+		for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+		{
+			sb_append(&sb, "\t", i > 0);
+			sb_escape(&sb, fields[i], 0);
+		}
+		sb.size = FANOUT_SLOT_SIZE;
+		sb_append(&sb, "\n", 1);
+		return sb.len;
+	}
+
+	char const *keys[] = { 
+		"chan", "badges", "nick", "dname", "color", "id", "text" 
+	};
+	char const *vals[] = { 
+		m->chan, m->badges, m->nick, m->dname, m->color, m->id, m->text 
+	};
+	int tombstone_keys[] = { 1, 0, 1, 0, 0, 1, 0 }; // chan, nick and id
+	sb_append(&sb, "{\"ts\":", 6);
+	sb_append(&sb, num, strlen(num));
+	if (m->tombstone)
+	{
+		sb_append(&sb, ",\"tombstone\":true", 17);
+	}
+	else if (m->notice)
+	{
+		sb_append(&sb, ",\"notice\":true", 14);
+	}
+	else
+	{
+		sb_append(&sb, m->action ? ",\"action\":true" : ",\"action\":false", m->action ? 14 : 15);
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i)
+	{
+		if (m->tombstone && !tombstone_keys[i])
+		{
+			continue;
+		}
+
+		// Every value but the last gets closed by the next separator
+		sb_append(&sb, n ? "\",\"" : ",\"", n ? 3 : 2);
+		sb_append(&sb, keys[i], strlen(keys[i]));
+		sb_append(&sb, "\":\"", 3);
+		sb_escape(&sb, vals[i], 1);
+		++n;
+	}
+	sb.size = FANOUT_SLOT_SIZE;
+	sb_append(&sb, "\"}\n", 3);
+	return sb.len;
+}
+
+/*
+ * Creates the Unix domain socket at path and starts listening on it. A
+ * socket left at path by an earlier run gets replaced, anything else is an
+ * error. Returns the fan-out server or NULL on error.
+ */
+static fanout_s*
+fanout_open(char const *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	// Remove a stale socket left over from an earlier run, but nothing else
+	if (unlink_socket(path) == -1)
+	{
+		return NULL;
+	}
+
+	fanout_s *fo = calloc(1, sizeof(fanout_s));
+	if (fo == NULL)
+	{
+		return NULL;
+	}
+	fo->ring = calloc(FANOUT_RING, sizeof(fanout_slot_s));
+	fo->path = path;
+
+	for (int i = 0; i < FANOUT_MAX_CLIENTS; ++i)
+	{
+		fo->clients[i].fd = -1;
+	}
+
+	fo->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fo->ring == NULL || fo->fd == -1 ||
+			bind(fo->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+			listen(fo->fd, FANOUT_MAX_CLIENTS) == -1)
+	{
+		if (fo->fd != -1)
+		{
+			close(fo->fd);
+		}
+		free(fo->ring);
+		free(fo);
+		return NULL;
+	}
+
+	return fo;
+}
+
+static void
+fanout_drop(fanout_s *fo, fanout_client_s *c)
+{
+	if (c->subscribed)
+	{
+		fo->subscribers[c->format]--;
+	}
+	close(c->fd);
+	memset(c, 0, sizeof(fanout_client_s));
+	c->fd = -1;
+}
+
+static void
+fanout_close(fanout_s *fo)
+{
+	for (int i = 0; i < FANOUT_MAX_CLIENTS; ++i)
+	{
+		if (fo->clients[i].fd != -1)
+		{
+			fanout_drop(fo, &fo->clients[i]);
+		}
+	}
+	close(fo->fd);
+	unlink(fo->path);
+	free(fo->ring);
+	free(fo);
+}
+
+/*
+ * Parses a client's subscription line. Unknown options are ignored.
+ * From here on, the client will receive all new matching events.
+ */
+static void
+fanout_subscribe(fanout_s *fo, fanout_client_s *c, char *line)
+{
+	c->format = FANOUT_FORMAT_TSV;
+
+	char *save = NULL;
+	for (char *tok = strtok_r(line, " \r", &save); tok; tok = strtok_r(NULL, " \r", &save))
+	{
+		if (strncmp(tok, "format=", 7) == 0 && fanout_format(tok + 7) != -1)
+		{
+			c->format = fanout_format(tok + 7);
+		}
+		else if (strncmp(tok, "nick=", 5) == 0)
+		{
+			snprintf(c->nick, TWIRC_NICK_SIZE, "%s", tok + 5);
+		}
+		else if (strncmp(tok, "match=", 6) == 0)
+		{
+			snprintf(c->match, FANOUT_LINE_SIZE, "%s", tok + 6);
+		}
+		else if (strcmp(tok, "mods") == 0)
+		{
+			c->flags |= EVENT_MOD;
+		}
+		else if (strcmp(tok, "subs") == 0)
+		{
+			c->flags |= EVENT_SUB;
+		}
+		else if (strcmp(tok, "actions") == 0)
+		{
+			c->flags |= EVENT_ACTION;
+		}
+	}
+
+	c->subscribed = 1;
+	c->seq = fo->head;
+	fo->subscribers[c->format]++;
+}
+
+/*
+ * Returns 1 if the event in slot passes the client's filters, otherwise 0.
+ */
+static int
+fanout_match(fanout_client_s const *c, fanout_slot_s const *slot)
+{
+	if (slot->flags & EVENT_TOMBSTONE)
+	{
+		return !c->nick[0] || !slot->nick[0] || strcasecmp(c->nick, slot->nick) == 0;
+	}
+	if ((slot->flags & c->flags) != c->flags)
+	{
+		return 0;
+	}
+	if (c->nick[0] && strcasecmp(c->nick, slot->nick) != 0)
+	{
+		return 0;
+	}
+	if (c->match[0] && strstr(slot->text, c->match) == NULL)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sends as many pending events to the client as its socket will take.
+ * Returns 0 on success, -1 if the client has been dropped.
+ */
+static int
+fanout_send(fanout_s *fo, fanout_client_s *c)
+{
+	for (; c->seq < fo->head; ++c->seq, c->off = 0)
+	{
+		// The event has already been overwritten, the client is too slow
+		if (fo->head - c->seq > FANOUT_RING)
+		{
+			fputs("*** Dropping slow fan-out client\n", stderr);
+			fanout_drop(fo, c);
+			fo->dropped++;
+			return -1;
+		}
+
+		fanout_slot_s *slot = &fo->ring[c->seq % FANOUT_RING];
+		if (c->off == 0 && !fanout_match(c, slot))
+		{
+			continue;
+		}
+
+		while (c->off < slot->len[c->format])
+		{
+			ssize_t n = send(c->fd, slot->data[c->format] + c->off,
+					slot->len[c->format] - c->off, MSG_NOSIGNAL);
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				return 0;
+			}
+			if (n == -1)
+			{
+				fanout_drop(fo, c);
+				return -1;
+			}
+			c->off += n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Stores the message in the ring buffer, serialized in all formats that 
+ * currently have subscribers, and sends it to all interested clients.
+ */
+static void
+fanout_publish(fanout_s *fo, message_s const *m)
+{
+	fanout_slot_s *slot = &fo->ring[fo->head % FANOUT_RING];
+
+	slot->flags = (m->action ? EVENT_ACTION : 0) |
+		(m->tombstone ? EVENT_TOMBSTONE : 0) |
+		(m->notice ? EVENT_NOTICE : 0) |
+		(is_mod(m->badges) == 1 ? EVENT_MOD : 0) |
+		(is_sub(m->badges) == 1 ? EVENT_SUB : 0);
+	snprintf(slot->nick, TWIRC_NICK_SIZE, "%s", m->nick ? m->nick : "");
+	snprintf(slot->text, FANOUT_SLOT_SIZE, "%s", m->text);
+
+	for (int f = 0; f < FANOUT_FORMATS; ++f)
+	{
+		slot->len[f] = fo->subscribers[f] ? fanout_serialize(m, f, slot->data[f]) : 0;
+	}
+
+	fo->head++;
+
+	for (int i = 0; i < FANOUT_MAX_CLIENTS; ++i)
+	{
+		if (fo->clients[i].fd != -1 && fo->clients[i].subscribed)
+		{
+			fanout_send(fo, &fo->clients[i]);
+		}
+	}
+}
+
+/*
+ * Accepts new clients, reads subscription lines and sends pending events.
+ * Should be called regularly, for example after every twirc_tick().
+ */
+static void
+fanout_service(fanout_s *fo)
+{
+	// Accept new clients, as long as we have room for them
+	int fd;
+	while ((fd = accept4(fo->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		int i = 0;
+		for (; i < FANOUT_MAX_CLIENTS && fo->clients[i].fd != -1; ++i);
+		if (i == FANOUT_MAX_CLIENTS)
+		{
+			close(fd);
+			continue;
+		}
+		fo->clients[i].fd = fd;
+	}
+
+	for (int i = 0; i < FANOUT_MAX_CLIENTS; ++i)
+	{
+		fanout_client_s *c = &fo->clients[i];
+		if (c->fd == -1)
+		{
+			continue;
+		}
+		if (c->subscribed)
+		{
+			fanout_send(fo, c);
+			continue;
+		}
+
+		// Read (more of) the subscription line
+		ssize_t n = recv(c->fd, c->line + c->line_len, FANOUT_LINE_SIZE - 1 - c->line_len, 0);
+		if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			fanout_drop(fo, c);
+			continue;
+		}
+		if (n == -1)
+		{
+			continue;
+		}
+		c->line_len += n;
+		c->line[c->line_len] = '\0';
+
+		char *eol = strchr(c->line, '\n');
+		if (eol)
+		{
+			*eol = '\0';
+			fanout_subscribe(fo, c, c->line);
+		}
+		else if (c->line_len == FANOUT_LINE_SIZE - 1)
+		{
+			fanout_drop(fo, c);
+		}
+	}
+}
+
+/*
+ * Services the clients until none of them is behind by more than limit events
+ * (or until we're asked to quit). Used for playback, where clients can set 
+ * the pace instead of getting dropped for being slow.
+ */
+static void
+fanout_wait(fanout_s *fo, uint64_t limit)
+{
+	while (running)
+	{
+		fanout_service(fo);
+
+		struct pollfd fds[FANOUT_MAX_CLIENTS];
+		nfds_t n = 0;
+		for (int i = 0; i < FANOUT_MAX_CLIENTS; ++i)
+		{
+			fanout_client_s *c = &fo->clients[i];
+			if (c->fd != -1 && c->subscribed && fo->head - c->seq > limit)
+			{
+				fds[n++] = (struct pollfd) { .fd = c->fd, .events = POLLOUT };
+			}
+		}
+		if (n == 0)
+		{
+			return;
+		}
+		poll(fds, n, SERVICE_TICK);
+	}
+}
+
+/*
+ * Shared-memory ring
+ *
+ * Publishes all messages into a ring buffer in a POSIX shared memory object,
+ * from which co-located consumers can read them in place. The object starts
+ * with a header (shm_head_s), followed by SHM_SLOTS slots of SHM_SLOT_SIZE 
+ * bytes, each holding one record (shm_record_s). Record n (counting from 0)
+ * lives in slot n % SHM_SLOTS. All integers are in host byte order.
+ *
+ * The header's head holds the number of records published so far. A slot's
+ * seq is 0 while the record is being written and n + 1 once record n is 
+ * complete. To read record n, a consumer checks that seq is n + 1, reads the
+ * record in place, then checks seq again: if it changed in the meantime or 
+ * was already beyond n + 1 to begin with, the consumer has been overrun and
+ * should continue with record head - SHM_SLOTS or later.
+ *
+ * The header's futex gets incremented after every record. Consumers that 
+ * have caught up can FUTEX_WAIT on it (without FUTEX_PRIVATE_FLAG), after
+ * incrementing waiters; they should decrement waiters once woken up. The
+ * writer only issues FUTEX_WAKE if waiters is non-zero. Consumers need to 
+ * increment waiters with sequentially consistent ordering (or follow it with
+ * a full fence) before they read the futex value to wait on and check head 
+ * once more; the writer does the same for incrementing futex and reading 
+ * waiters. Otherwise, a wakeup can get lost on weakly ordered CPUs.
+ *
+ * Tombstones (see message_s) have EVENT_TOMBSTONE set in flags; their text 
+ * is the id of the message to delete, or empty. Notices (see message_s) have
+ * EVENT_NOTICE set; their text is Twitch's description of the event.
+ */
+
+/*
+ * Creates (or replaces) the shared memory object name and maps it.
+ * Returns the ring or NULL on error.
+ */
+static shm_ring_s*
+shm_ring_open(char const *name)
+{
+	size_t size = sizeof(shm_head_s) + (size_t) SHM_SLOTS * SHM_SLOT_SIZE;
+
+	// Start out with a fresh object, consumers of an old one keep theirs
+	shm_unlink(name);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1)
+	{
+		return NULL;
+	}
+	if (ftruncate(fd, size) == -1)
+	{
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return NULL;
+	}
+
+	shm_ring_s *ring = calloc(1, sizeof(shm_ring_s));
+	if (ring == NULL)
+	{
+		munmap(map, size);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	ring->name = name;
+	ring->size = size;
+	ring->head = map;
+	ring->slots = (unsigned char *) map + sizeof(shm_head_s);
+
+	// The object is zero-filled, so all that's left is the header
+	memcpy(ring->head->magic, SHM_MAGIC, 8);
+	ring->head->slot_size = SHM_SLOT_SIZE;
+	ring->head->slots = SHM_SLOTS;
+
+	return ring;
+}
+
+static void
+shm_ring_close(shm_ring_s *ring)
+{
+	munmap(ring->head, ring->size);
+	shm_unlink(ring->name);
+	free(ring);
+}
+
+/*
+ * Writes the message into the next slot and wakes up waiting consumers.
+ * Texts too long for a slot get truncated.
+ */
+static void
+shm_ring_publish(shm_ring_s *ring, message_s const *m)
+{
+	uint64_t n = atomic_load_explicit(&ring->head->head, memory_order_relaxed);
+	shm_record_s *rec = (shm_record_s *) (ring->slots + (n % SHM_SLOTS) * SHM_SLOT_SIZE);
+
+	// Mark the slot as being written before touching anything else
+	atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	size_t nick_len = m->nick ? strlen(m->nick) : 0;
+	nick_len = nick_len >= TWIRC_NICK_SIZE ? TWIRC_NICK_SIZE - 1 : nick_len;
+
+	// Tombstones carry the message id in place of the text
+	char const *text = m->tombstone ? (m->id ? m->id : "") : m->text;
+
+	size_t max = SHM_SLOT_SIZE - sizeof(shm_record_s) - nick_len - 2;
+	size_t text_len = strlen(text);
+	text_len = text_len > max ? max : text_len;
+
+	rgb_s rgb = hex_to_rgb(empty(m->color) ? "#FFFFFF" : m->color);
+
+	rec->ts = m->ts;
+	rec->color = empty(m->color) ? SHM_NO_COLOR : (rgb.r << 16) | (rgb.g << 8) | rgb.b;
+	rec->flags = (m->action ? EVENT_ACTION : 0) |
+		(m->tombstone ? EVENT_TOMBSTONE : 0) |
+		(m->notice ? EVENT_NOTICE : 0) |
+		(is_mod(m->badges) == 1 ? EVENT_MOD : 0) |
+		(is_sub(m->badges) == 1 ? EVENT_SUB : 0);
+	rec->nick_len = nick_len;
+	rec->text_len = text_len;
+
+	memcpy(rec->data, m->nick, nick_len);
+	rec->data[nick_len] = '\0';
+	memcpy(rec->data + nick_len + 1, text, text_len);
+	rec->data[nick_len + 1 + text_len] = '\0';
+
+	atomic_store_explicit(&rec->seq, n + 1, memory_order_release);
+	atomic_store_explicit(&ring->head->head, n + 1, memory_order_release);
+	// Bumping futex and checking waiters must not be reordered (neither may 
+	// the consumer's bumping waiters and reading futex), or a consumer that's
+	// just about to wait might miss its wakeup; hence sequential consistency
+	atomic_fetch_add_explicit(&ring->head->futex, 1, memory_order_seq_cst);
+
+	if (atomic_load_explicit(&ring->head->waiters, memory_order_seq_cst))
+	{
+		syscall(SYS_futex, &ring->head->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+/*
+ * Full-screen mode
+ *
+ * Instead of printing every message as it arrives, messages are pushed into
+ * a ring of entries. At most SCREEN_FPS times per second, the entries that 
+ * fit on screen are laid out into a buffer of cells (back) and compared to
+ * what the terminal currently shows (front). Only the parts that changed get
+ * written to the terminal, all in one go, after scrolling the terminal by the
+ * number of new rows. This way, no matter how many messages arrive between 
+ * two frames, the terminal only ever has to catch up with one screen worth.
+ *
+ * Entries are numbered in the order they were added; entry n lives at index
+ * n % SCREEN_ENTRIES of the ring. Tombstones (see message_s) are queued and 
+ * applied right before the next frame, all at once. To find the entries to 
+ * delete, chat messages are indexed by message id and by user name, in hash
+ * tables of entry numbers (+ 1, so that 0 means empty) with linear probing;
+ * the latter only holds the user's latest entry, which links to the previous
+ * one and so forth. Entries are removed from both indexes when overwritten.
+ */
+
+/*
+ * Reallocates the cell buffers for the new terminal size and schedules a 
+ * full repaint. Returns 0 on success, -1 on error (out of memory).
+ */
+static int
+screen_resize(screen_s *scr, uint16_t width, uint16_t height)
+{
+	free(scr->front);
+	free(scr->back);
+	free(scr->out);
+
+	scr->width = width ? width : 1;
+	scr->height = height ? height : 1;
+
+	size_t cells = (size_t) scr->width * scr->height;
+
+	// Worst case: every cell changes color, every row needs a cursor move
+	scr->out_size = cells * (SCREEN_MAX_SGR + SCREEN_CELL_BYTES) + scr->height * 16 + 64;
+
+	scr->front = calloc(cells, sizeof(screen_cell_s));
+	scr->back = calloc(cells, sizeof(screen_cell_s));
+	scr->out = malloc(scr->out_size);
+
+	scr->full = 1;
+	scr->dirty = 1;
+
+	return (scr->front && scr->back && scr->out) ? 0 : -1;
+}
+
+static void
+screen_free(screen_s *scr)
+{
+	free(scr->entries);
+	free(scr->ids);
+	free(scr->users);
+	free(scr->line);
+	free(scr->rows);
+	free(scr->front);
+	free(scr->back);
+	free(scr->out);
+	free(scr);
+}
+
+/*
+ * Creates a screen of the given size. Returns the screen or NULL on error.
+ */
+static screen_s*
+screen_init(int colormode, uint16_t width, uint16_t height)
+{
+	screen_s *scr = calloc(1, sizeof(screen_s));
+	if (scr == NULL)
+	{
+		return NULL;
+	}
+
+	scr->colormode = colormode;
+	scr->entries = calloc(SCREEN_ENTRIES, sizeof(screen_entry_s));
+	scr->line = calloc(SCREEN_LINE_CELLS, sizeof(screen_cell_s));
+	scr->rows = calloc(SCREEN_LINE_CELLS + 1, sizeof(size_t));
+	scr->ids = calloc(SCREEN_INDEX_SIZE, sizeof(uint64_t));
+	scr->users = calloc(SCREEN_INDEX_SIZE, sizeof(uint64_t));
+
+	if (scr->entries == NULL || scr->line == NULL || scr->rows == NULL || 
+			scr->ids == NULL || scr->users == NULL || screen_resize(scr, width, height) == -1)
+	{
+		screen_free(scr);
+		return NULL;
+	}
+
+	return scr;
+}
+
+/*
+ * Returns the key of the entry for the given index: its message id if user
+ * is 0, otherwise its user name.
+ */
+static void const*
+screen_key(screen_entry_s const *e, int user)
+{
+	return user ? (void const *) e->user : (void const *) e->id;
+}
+
+/*
+ * Hashes a key as returned by screen_key().
+ */
+static uint32_t
+screen_hash(void const *key, int user)
+{
+	if (user)
+	{
+		return fnv1a(key);
+	}
+
+	// Message ids are random enough as they are
+	uint32_t h;
+	memcpy(&h, key, sizeof(h));
+	return h;
+}
+
+/*
+ * Returns the position of key in index (scr->ids if user is 0, otherwise 
+ * scr->users) or, if it isn't in there, the free position it would go to.
+ */
+static size_t
+screen_find(screen_s const *scr, uint64_t const *index, void const *key, int user)
+{
+	size_t mask = SCREEN_INDEX_SIZE - 1;
+	size_t i = screen_hash(key, user) & mask;
+
+	// The index is never more than half full, so we'll hit a free position
+	for (; index[i]; i = (i + 1) & mask)
+	{
+		screen_entry_s const *e = &scr->entries[(index[i] - 1) % SCREEN_ENTRIES];
+		if (user ? strcmp(e->user, key) == 0 : memcmp(e->id, key, 16) == 0)
+		{
+			return i;
+		}
+	}
+	return i;
+}
+
+/*
+ * Removes the entry from index, if it's the one in there for its key. The 
+ * entries following it are moved up as needed, so that lookups still work.
+ */
+static void
+screen_unindex(screen_s *scr, uint64_t *index, screen_entry_s const *e, int user)
+{
+	size_t mask = SCREEN_INDEX_SIZE - 1;
+	size_t i = screen_find(scr, index, screen_key(e, user), user);
+
+	if (index[i] == 0 || &scr->entries[(index[i] - 1) % SCREEN_ENTRIES] != e)
+	{
+		return;
+	}
+
+	index[i] = 0;
+	for (size_t j = (i + 1) & mask; index[j]; j = (j + 1) & mask)
+	{
+		screen_entry_s const *f = &scr->entries[(index[j] - 1) % SCREEN_ENTRIES];
+		size_t home = screen_hash(screen_key(f, user), user) & mask;
+
+		// Move it into the gap, unless that's before its home position
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			index[i] = index[j];
+			index[j] = 0;
+			i = j;
+		}
+	}
+}
+
+/*
+ * Returns the next entry to fill in, making room in the ring if need be.
+ */
+static screen_entry_s*
+screen_next(screen_s *scr)
+{
+	screen_entry_s *e = &scr->entries[scr->head % SCREEN_ENTRIES];
+
+	// Drop the entry we're about to overwrite from the indexes
+	if (e->has_id)
+	{
+		screen_unindex(scr, scr->ids, e, 0);
+	}
+	if (e->user[0])
+	{
+		screen_unindex(scr, scr->users, e, 1);
+	}
+
+	e->deleted = 0;
+	e->has_id = 0;
+	e->prev = 0;
+	e->user[0] = '\0';
+
+	scr->head++;
+	scr->dirty = 1;
+	return e;
+}
+
+/*
+ * Adds a chat message to the screen. It will show up with the next frame.
+ * The timestamp ts is in seconds, 0 meaning the current time.
+ */
+static void
+screen_push(screen_s *scr, char const *tsformat, int ts, char const *badge, char const *nick, message_s const *m)
+{
+	screen_entry_s *e = screen_next(scr);
+
+	rgb_s rgb = hex_to_rgb(empty(m->color) ? "#FFFFFF" : m->color);
+
+	e->status = 0;
+	e->action = m->action;
+	e->color = (rgb.r << 16) | (rgb.g << 8) | rgb.b;
+	timestamp_str(tsformat, ts, e->head, TIMESTAMP_BUFFER);
+	snprintf(e->nick, sizeof(e->nick), "%s%s", badge, nick);
+	snprintf(e->text, SCREEN_TEXT_SIZE, "%s", m->text);
+
+	// Index the entry, so that tombstones can find it
+	if (uuid_parse(m->id, e->id) == 0)
+	{
+		e->has_id = 1;
+		scr->ids[screen_find(scr, scr->ids, e->id, 0)] = scr->head;
+	}
+	if (!empty(m->nick))
+	{
+		snprintf(e->user, TWIRC_NICK_SIZE, "%s", m->nick);
+		size_t i = screen_find(scr, scr->users, e->user, 1);
+		e->prev = scr->users[i];
+		scr->users[i] = scr->head;
+	}
+}
+
+/*
+ * Adds a status line to the screen. It will show up with the next frame.
+ */
+static void
+screen_push_status(screen_s *scr, char const *str)
+{
+	screen_entry_s *e = screen_next(scr);
+
+	e->status = 1;
+	e->action = 0;
+	e->color = SCREEN_NO_COLOR;
+	e->head[0] = '\0';
+	e->nick[0] = '\0';
+	snprintf(e->text, SCREEN_TEXT_SIZE, "%s", str);
+}
+
+/*
+ * Applies all queued deletions by marking the affected entries as deleted.
+ */
+static void
+screen_apply(screen_s *scr)
+{
+	for (size_t d = 0; d < scr->deletions; ++d)
+	{
+		screen_deletion_s const *del = &scr->pending[d];
+
+		if (del->has_id)
+		{
+			uint64_t n = scr->ids[screen_find(scr, scr->ids, del->id, 0)];
+			if (n && n - 1 < del->before)
+			{
+				scr->entries[(n - 1) % SCREEN_ENTRIES].deleted = 1;
+			}
+		}
+		else if (del->user[0])
+		{
+			// Follow the user's entries, as long as they haven't been overwritten
+			uint64_t n = scr->users[screen_find(scr, scr->users, del->user, 1)];
+			while (n && scr->head - (n - 1) <= SCREEN_ENTRIES)
+			{
+				screen_entry_s *e = &scr->entries[(n - 1) % SCREEN_ENTRIES];
+				e->deleted |= n - 1 < del->before;
+				n = e->prev;
+			}
+		}
+		else if (del->before > scr->cleared)
+		{
+			scr->cleared = del->before;
+		}
+	}
+	scr->deletions = 0;
+}
+
+/*
+ * Queues the deletion of the messages referred to by the tombstone m. It 
+ * will be applied right before the next frame, to entries added before now.
+ */
+static void
+screen_delete(screen_s *scr, message_s const *m)
+{
+	if (scr->deletions == SCREEN_DELETIONS)
+	{
+		screen_apply(scr);
+	}
+
+	screen_deletion_s *del = &scr->pending[scr->deletions];
+	del->before = scr->head;
+	del->has_id = !empty(m->id);
+	snprintf(del->user, TWIRC_NICK_SIZE, "%s", m->nick ? m->nick : "");
+
+	// We couldn't have indexed a message by an invalid id
+	if (del->has_id && uuid_parse(m->id, del->id) == -1)
+	{
+		return;
+	}
+
+	scr->deletions++;
+	scr->dirty = 1;
+}
+
+/*
+ * Appends str as cells of the given color to line, which holds n cells so 
+ * far. Every cell is one terminal column: wide characters (per wcwidth()) 
+ * take a second cell with len 0, zero-width characters like combining marks 
+ * are added to the previous cell. Control characters become spaces, invalid 
+ * UTF-8 becomes '?'. Returns the new number of cells in line.
+ */
+static size_t
+screen_cells(screen_cell_s *line, size_t n, char const *str, uint32_t color)
+{
+	for (unsigned char const *c = (unsigned char const *) str; *c && n < SCREEN_LINE_CELLS; )
+	{
+		size_t len = *c < 0x80 ? 1 : (*c >> 5) == 0x6 ? 2 : (*c >> 4) == 0xE ? 3 : (*c >> 3) == 0x1E ? 4 : 0;
+		uint32_t cp = len == 1 ? *c : len == 2 ? *c & 0x1F : len == 3 ? *c & 0x0F : *c & 0x07;
+
+		// Make sure the whole sequence is there and consists of continuation bytes
+		for (size_t i = 1; i < len; ++i)
+		{
+			if ((c[i] & 0xC0) != 0x80)
+			{
+				len = 0;
+				break;
+			}
+			cp = (cp << 6) | (c[i] & 0x3F);
+		}
+
+		unsigned char const *seq = c;
+		c += len ? len : 1;
+
+		int width = 1;
+		if (len == 0)
+		{
+			cp = '?';
+			len = 1;
+		}
+		else if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0))
+		{
+			cp = ' ';
+			len = 1;
+		}
+		else if (cp >= 0x80)
+		{
+			// Unknown to the locale (e.g. not UTF-8): assume a single column
+			width = wcwidth((wchar_t) cp);
+			width = width < 0 ? 1 : width;
+		}
+
+		if (width == 0)
+		{
+			// Goes with the previous character, if there's room for it
+			screen_cell_s *prev = n == 0 ? NULL : line[n - 1].len ? &line[n - 1] : n > 1 ? &line[n - 2] : NULL;
+			if (prev && prev->len + len <= SCREEN_CELL_BYTES)
+			{
+				memcpy(prev->ch + prev->len, seq, len);
+				prev->len += len;
+			}
+			continue;
+		}
+		if (n + width > SCREEN_LINE_CELLS)
+		{
+			break;
+		}
+
+		screen_cell_s *cell = &line[n++];
+		memset(cell->ch, 0, SCREEN_CELL_BYTES);
+		cell->color = color;
+		cell->len = len;
+		if (cp < 0x80)
+		{
+			cell->ch[0] = cp;
+		}
+		else
+		{
+			memcpy(cell->ch, seq, len);
+		}
+
+		if (width == 2)
+		{
+			screen_cell_s *half = &line[n++];
+			memset(half, 0, sizeof(screen_cell_s));
+			half->color = color;
+		}
+	}
+	return n;
+}
+
+/*
+ * Breaks the n cells in scr->line into rows of at most w cells, without 
+ * splitting wide characters. Stores the first cell of every row, followed 
+ * by n, in scr->rows and returns the number of rows (at least one).
+ */
+static size_t
+screen_wrap(screen_s *scr, size_t n, size_t w)
+{
+	size_t rows = 0;
+	scr->rows[rows++] = 0;
+	for (size_t i = 0, col = 0; i < n; ++i, ++col)
+	{
+		int wide = i + 1 < n && scr->line[i + 1].len == 0;
+		if (col > 0 && col + (wide ? 2 : 1) > w)
+		{
+			scr->rows[rows++] = i;
+			col = 0;
+		}
+		i += wide;
+		col += wide;
+	}
+	scr->rows[rows] = n;
+	return rows;
+}
+
+/*
+ * Lays out an entry into scr->line, one cell after the other, and returns 
+ * the number of cells used. Wrapping is up to the caller. The text of 
+ * deleted entries gets replaced.
+ */
+static size_t
+screen_layout(screen_s *scr, screen_entry_s const *e, int deleted)
+{
+	size_t n = 0;
+
+	if (e->status)
+	{
+		return screen_cells(scr->line, n, e->text, SCREEN_NO_COLOR);
+	}
+
+	if (!empty(e->head))
+	{
+		n = screen_cells(scr->line, n, e->head, SCREEN_NO_COLOR);
+		n = screen_cells(scr->line, n, " ", SCREEN_NO_COLOR);
+	}
+	n = screen_cells(scr->line, n, e->nick, e->color);
+	n = screen_cells(scr->line, n, e->action ? "  " : ": ", SCREEN_NO_COLOR);
+	if (deleted || e->deleted)
+	{
+		return screen_cells(scr->line, n, SCREEN_DELETED, SCREEN_NO_COLOR);
+	}
+	n = screen_cells(scr->line, n, e->text, e->action ? e->color : SCREEN_NO_COLOR);
+	return n;
+}
+
+/*
+ * Appends the escape sequence that switches to the given color to sb.
+ */
+static void
+screen_sgr(screen_s *scr, strbuf_s *sb, uint32_t color)
+{
+	if (color == SCREEN_NO_COLOR)
+	{
+		sb_append(sb, ANSI_FONT_RESET, strlen(ANSI_FONT_RESET));
+		return;
+	}
+
+	char buf[SCREEN_MAX_SGR];
+	rgb_s rgb = { .r = (color >> 16) & 0xFF, .g = (color >> 8) & 0xFF, .b = color & 0xFF };
+	color_prefix(scr->colormode, &rgb, buf, SCREEN_MAX_SGR);
+	sb_append(sb, buf, strlen(buf));
+}
+
+/*
+ * Paints a frame: lays out as many of the newest entries as fit on screen,
+ * scrolls the terminal by the number of rows added since the last frame and 
+ * then writes all cells that differ from what's on the terminal to fd.
+ */
+static void
+screen_paint(screen_s *scr, int fd)
+{
+	size_t w = scr->width;
+	size_t h = scr->height;
+	screen_cell_s blank = { .ch = " ", .len = 1, .color = SCREEN_NO_COLOR };
+
+	for (size_t i = 0; i < w * h; ++i)
+	{
+		scr->back[i] = blank;
+	}
+
+	// Lay out entries bottom-up, starting with the newest one
+	size_t row = h;
+	size_t added = 0;
+	for (uint64_t i = scr->head; i > 0 && row > 0 && scr->head - i < SCREEN_ENTRIES; --i)
+	{
+		size_t n = screen_layout(scr, &scr->entries[(i - 1) % SCREEN_ENTRIES], i - 1 < scr->cleared);
+		size_t rows = screen_wrap(scr, n, w);
+
+		if (i > scr->painted)
+		{
+			added += rows;
+		}
+
+		for (size_t r = rows; r > 0 && row > 0; --r)
+		{
+			size_t off = scr->rows[r - 1];
+			size_t len = scr->rows[r] - off;
+
+			// Only with a single column: a wide character that doesn't fit
+			if (len > w)
+			{
+				len = w;
+				scr->line[off] = blank;
+			}
+			memcpy(scr->back + --row * w, scr->line + off, len * sizeof(screen_cell_s));
+		}
+	}
+
+	strbuf_s sb = { .buf = scr->out, .size = scr->out_size };
+	char buf[32];
+
+	if (scr->full || added >= h)
+	{
+		// Start over with an empty terminal
+		sb_append(&sb, ANSI_FONT_RESET ANSI_CLEAR_SCREEN, strlen(ANSI_FONT_RESET ANSI_CLEAR_SCREEN));
+		for (size_t i = 0; i < w * h; ++i)
+		{
+			scr->front[i] = blank;
+		}
+	}
+	else if (added)
+	{
+		// Let the terminal move everything up, then do the same with front
+		sb_append(&sb, buf, snprintf(buf, 32, ANSI_FONT_RESET "\x1b[%zuS", added));
+		memmove(scr->front, scr->front + added * w, (h - added) * w * sizeof(screen_cell_s));
+		for (size_t i = (h - added) * w; i < w * h; ++i)
+		{
+			scr->front[i] = blank;
+		}
+	}
+
+	// Write the changed part of every row
+	uint32_t color = SCREEN_NO_COLOR;
+	for (size_t y = 0; y < h; ++y)
+	{
+		screen_cell_s *f = scr->front + y * w;
+		screen_cell_s *b = scr->back + y * w;
+
+		size_t x0 = 0;
+		size_t x1 = w;
+		for (; x0 < w && !memcmp(&f[x0], &b[x0], sizeof(screen_cell_s)); ++x0);
+		for (; x1 > x0 && !memcmp(&f[x1 - 1], &b[x1 - 1], sizeof(screen_cell_s)); --x1);
+		if (x0 == x1)
+		{
+			continue;
+		}
+
+		// Never start in the right half of a wide character
+		for (; x0 > 0 && b[x0].len == 0; --x0);
+
+		sb_append(&sb, buf, snprintf(buf, 32, "\x1b[%zu;%zuH", y + 1, x0 + 1));
+		for (size_t x = x0; x < x1; ++x)
+		{
+			if (b[x].color != color)
+			{
+				screen_sgr(scr, &sb, b[x].color);
+				color = b[x].color;
+			}
+			sb_append(&sb, b[x].ch, b[x].len);
+		}
+	}
+	if (color != SCREEN_NO_COLOR)
+	{
+		screen_sgr(scr, &sb, SCREEN_NO_COLOR);
+	}
+
+	// What's in back is now on the terminal
+	screen_cell_s *tmp = scr->front;
+	scr->front = scr->back;
+	scr->back = tmp;
+
+	for (size_t off = 0; off < sb.len; )
+	{
+		ssize_t n = write(fd, sb.buf + off, sb.len - off);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n == -1)
+		{
+			break;
+		}
+		off += n;
+		counter_add(&metrics_local()->bytes, n);
+	}
+
+	scr->painted = scr->head;
+	scr->full = 0;
+	scr->dirty = 0;
+}
+
+/*
+ * Paints a frame if there is something new and the last frame is at least 
+ * 1/SCREEN_FPS seconds ago. Returns the time (ms) until the next frame is 
+ * due, or timeout if there's nothing to paint.
+ */
+static int
+screen_update(screen_s *scr, int timeout)
+{
+	if (!scr->dirty)
+	{
+		return timeout;
+	}
+
+	uint64_t now = now_ms();
+	if (now < scr->next_frame)
+	{
+		return scr->next_frame - now;
+	}
+
+	fflush(stdout);
+	screen_apply(scr);
+	screen_paint(scr, STDOUT_FILENO);
+	scr->next_frame = now + 1000 / SCREEN_FPS;
+	return timeout;
+}
+
+/*
+ * Prints a status line, or adds it to the screen in full-screen mode.
+ */
+static void
+print_status(state_s *state, char const *str)
+{
+	if (state->screen)
+	{
+		screen_push_status(state->screen, str);
+		return;
+	}
+	out_printf("%s\n", str);
+}
+
+/*
+ * Queues the tombstone's deletions in full-screen mode. Otherwise, as what's
+ * been printed stays printed, we print a status line instead.
+ */
+static void
+output_tombstone(state_s *state, message_s const *m)
+{
+	char buf[TWIRC_NICK_SIZE + 32];
+	int all = empty(m->id) && empty(m->nick);
+
+	if (all)
+	{
+		snprintf(buf, sizeof(buf), "*** Chat cleared");
+	}
+	else if (empty(m->id))
+	{
+		snprintf(buf, sizeof(buf), "*** Messages by %s deleted", m->nick);
+	}
+	else
+	{
+		snprintf(buf, sizeof(buf), "*** Message%s%s deleted", 
+				empty(m->nick) ? "" : " by ", empty(m->nick) ? "" : m->nick);
+	}
+
+	if (state->screen)
+	{
+		screen_delete(state->screen, m);
+
+		// Deleted messages stay on screen, so point out that all of them are
+		if (all)
+		{
+			screen_push_status(state->screen, buf);
+		}
+		return;
+	}
+	print_status(state, buf);
+}
+
+/*
+ * Prints the message, either according to the render plan, if there is one,
+ * or with the regular print functions; in full-screen mode, the message gets
+ * added to the screen instead. The timestamp ts is in seconds, 0 meaning 
+ * the current time. The message text might get modified.
+ */
+static void
+output_message(state_s *state, int ts, message_s const *m)
+{
+	options_s *opts = state->opts;
+
+	if (m->tombstone)
+	{
+		output_tombstone(state, m);
+		return;
+	}
+	if (m->notice)
+	{
+		char buf[SCREEN_TEXT_SIZE];
+		snprintf(buf, sizeof(buf), "*** %s", m->text);
+		print_status(state, buf);
+		return;
+	}
+
+	if (state->screen)
+	{
+		char *nick = arena_alloc(&state->arena, TWIRC_NICK_SIZE);
+		if (nick == NULL)
+		{
+			return;
+		}
+		snprintf(nick, TWIRC_NICK_SIZE, "%s", opts->displaynames && !empty(m->dname) ? m->dname : m->nick);
+		screen_push(state->screen, opts->timestamp, ts, 
+				is_mod(m->badges) == 1 ? "@" : (is_sub(m->badges) == 1 ? "+" : ""), nick, m);
+		return;
+	}
+
+	if (state->plan)
+	{
+		render_plan_print(state->plan, &state->arena, ts, m);
+		return;
+	}
+
+	// Prepare nickname string
+	char *nick = arena_alloc(&state->arena, TWIRC_NICK_SIZE);
+	if (nick == NULL)
+	{
+		return;
+	}
+	snprintf(nick, TWIRC_NICK_SIZE, "%s", opts->displaynames && !empty(m->dname) ? m->dname : m->nick);
+
+	print_message(opts, &state->arena, ts, m->badges, nick, m->text, m->action, m->color);
+}
+
+
+/*
+ * Archives, publishes and prints the message, as requested. This is the hot
+ * path: all scratch memory comes from the arena, which gets reset for every
+ * message, so that no heap allocations happen here once we're warmed up.
+ */
+static void
+process_message(state_s *state, int ts, message_s *m)
+{
+	arena_reset(&state->arena);
+	ALLOC_STATS_ENTER();
+
+	uint64_t start = state->metrics ? now_ns() : 0;
+	state->tick_busy = state->tick_busy ? state->tick_busy : start;
+
+	// Archive and publish the message first, as printing it might modify it
+	if (state->archive && archive_write(state->archive, m) == -1)
+	{
+		fputs("*** Error writing archive\n", stderr);
+	}
+	if (state->fanout)
+	{
+		fanout_publish(state->fanout, m);
+	}
+	if (state->ring)
+	{
+		shm_ring_publish(state->ring, m);
+	}
+
+	output_message(state, ts, m);
+
+	metrics_s *metrics = metrics_local();
+	counter_add(&metrics->messages, !m->tombstone && !m->notice);
+	if (state->metrics)
+	{
+		histogram_observe(&metrics->render, now_ns() - start);
+	}
+
+	ALLOC_STATS_LEAVE();
+}
+
+/*
+ * Reads the record at *p into rec and advances *p past it.
+ * Returns 0 on success, -1 if the record would extend beyond end.
+ */
+static int
+archive_read(unsigned char const **p, unsigned char const *end, archive_record_s *rec)
+{
+	memset(rec, 0, sizeof(archive_record_s));
+
+	if (get_varint(p, end, &rec->delta) == -1 || get_varint(p, end, &rec->flags) == -1)
+	{
+		return -1;
+	}
+	if (!(rec->flags & ARCHIVE_FLAG_DICT))
+	{
+		for (int i = 0; i < 4 + !!(rec->flags & ARCHIVE_FLAG_CHAN); ++i)
+		{
+			if (get_varint(p, end, &rec->ids[i]) == -1)
+			{
+				return -1;
+			}
+		}
+	}
+	if (rec->flags & ARCHIVE_FLAG_ID)
+	{
+		if (end - *p < 16)
+		{
+			return -1;
+		}
+		rec->id = *p;
+		*p += 16;
+	}
+	if (get_varint(p, end, &rec->len) == -1 || rec->len > (uint64_t) (end - *p))
+	{
+		return -1;
+	}
+	rec->str = *p;
+	*p += rec->len;
+	return 0;
+}
+
+/*
+ * Returns the number of records in the block and sets *end to the end of 
+ * its used part. Returns 0 if the block isn't valid (never written).
+ */
+static size_t
+archive_block(unsigned char const *block, unsigned char const **end)
+{
+	size_t records = block[8] | (block[9] << 8);
+	size_t used = block[10] | (block[11] << 8);
+
+	if (used < ARCHIVE_BLOCK_HEAD || used > ARCHIVE_BLOCK_SIZE)
+	{
+		return 0;
+	}
+	*end = block + used;
+	return records;
+}
+
+/*
+ * For archives with footer: validates footer and index, sets *blocks and 
+ * *index accordingly and loads the dictionary into *dict (indexed by id, 
+ * starting at 1) and *pool. Returns the number of strings or -1 on error
+ * (out of memory, corrupt archive).
+ */
+static int64_t
+archive_load(unsigned char const *map, size_t size, size_t *blocks, 
+		unsigned char const **index, char ***dict, char **pool)
+{
+	unsigned char const *foot = map + size - ARCHIVE_FOOT_SIZE;
+	uint64_t dict_off  = get_u64(foot + 8);
+	uint64_t index_off = get_u64(foot + 16);
+
+	if (dict_off < ARCHIVE_HEAD_SIZE || dict_off > index_off || 
+			index_off > size - ARCHIVE_FOOT_SIZE ||
+			(dict_off - ARCHIVE_HEAD_SIZE) % ARCHIVE_BLOCK_SIZE)
+	{
+		return -1;
+	}
+
+	// The index needs to have an entry for every block, right up to the footer
+	*blocks = (dict_off - ARCHIVE_HEAD_SIZE) / ARCHIVE_BLOCK_SIZE;
+	if (index_off + *blocks * 8 != size - ARCHIVE_FOOT_SIZE)
+	{
+		return -1;
+	}
+	*index = map + index_off;
+
+	// Load the dictionary into NUL-terminated strings
+	unsigned char const *p = map + dict_off;
+	unsigned char const *end = map + index_off;
+	uint64_t count;
+	if (get_varint(&p, end, &count) == -1 || count > (uint64_t) (end - p))
+	{
+		return -1;
+	}
+	*dict = malloc((count + 1) * sizeof(char *));
+	*pool = malloc((end - p) + count);
+	if (*dict == NULL || *pool == NULL)
+	{
+		return -1;
+	}
+	(*dict)[0] = NULL;
+	char *str = *pool;
+	for (uint64_t i = 1; i <= count; ++i)
+	{
+		uint64_t len;
+		if (get_varint(&p, end, &len) == -1 || len > (uint64_t) (end - p))
+		{
+			return -1;
+		}
+		memcpy(str, p, len);
+		str[len] = '\0';
+		(*dict)[i] = str;
+		str += len + 1;
+		p += len;
+	}
+	return count;
+}
+
+/*
+ * For archives without footer: counts the valid blocks, which have been 
+ * written in full, and collects the dictionary from their definition records
+ * into *dict (indexed by id, starting at 1) and *pool. Returns the number of
+ * strings or -1 on error (out of memory, corrupt archive).
+ */
+static int64_t
+archive_scan(unsigned char const *map, size_t size, size_t *blocks, char ***dict, char **pool)
+{
+	size_t max = (size - ARCHIVE_HEAD_SIZE) / ARCHIVE_BLOCK_SIZE;
+	unsigned char const *end = map;
+
+	for (*blocks = 0; *blocks < max; ++*blocks)
+	{
+		if (archive_block(map + ARCHIVE_HEAD_SIZE + *blocks * ARCHIVE_BLOCK_SIZE, &end) == 0)
+		{
+			break;
+		}
+	}
+
+	// First count the strings and their bytes, then copy them
+	uint64_t count = 0;
+	uint64_t bytes = 0;
+	for (int copy = 0; copy < 2; ++copy)
+	{
+		char *str = *pool;
+		uint64_t n = 0;
+
+		for (size_t b = 0; b < *blocks; ++b)
+		{
+			unsigned char const *p = map + ARCHIVE_HEAD_SIZE + b * ARCHIVE_BLOCK_SIZE;
+			size_t records = archive_block(p, &end);
+			archive_record_s rec;
+
+			p += ARCHIVE_BLOCK_HEAD;
+			for (size_t r = 0; r < records; ++r)
+			{
+				if (archive_read(&p, end, &rec) == -1)
+				{
+					return -1;
+				}
+				if (!(rec.flags & ARCHIVE_FLAG_DICT))
+				{
+					continue;
+				}
+				if (copy)
+				{
+					memcpy(str, rec.str, rec.len);
+					str[rec.len] = '\0';
+					(*dict)[++n] = str;
+					str += rec.len + 1;
+				}
+				else
+				{
+					count++;
+					bytes += rec.len + 1;
+				}
+			}
+		}
+
+		if (!copy)
+		{
+			*dict = malloc((count + 1) * sizeof(char *));
+			*pool = malloc(bytes + 1);
+			if (*dict == NULL || *pool == NULL)
+			{
+				return -1;
+			}
+			(*dict)[0] = NULL;
+		}
+	}
+	return count;
+}
+
+/*
+ * Metrics endpoint
+ *
+ * Serves the metrics in Prometheus' text format via HTTP, on a TCP port or
+ * a Unix domain socket. Every request gets the same response, regardless 
+ * of method or path. Counters are only summed up here, at scrape time.
+ */
+
+/*
+ * Starts listening for scrapes on addr, which is either the path of a Unix
+ * domain socket (if it contains a '/'), "host:port" or just a port, in which
+ * case we listen on localhost only. A socket left at the path by an earlier 
+ * run gets replaced, anything else is an error. Returns the server or NULL 
+ * on error.
+ */
+static metrics_server_s*
+metrics_open(char const *addr)
+{
+	metrics_server_s *ms = calloc(1, sizeof(metrics_server_s));
+	if (ms == NULL)
+	{
+		return NULL;
+	}
+	for (int i = 0; i < METRICS_MAX_CLIENTS; ++i)
+	{
+		ms->clients[i] = -1;
+	}
+
+	if (strchr(addr, '/'))
+	{
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+		if (strlen(addr) >= sizeof(sun.sun_path))
+		{
+			free(ms);
+			return NULL;
+		}
+		strcpy(sun.sun_path, addr);
+
+		// Remove a stale socket left over from an earlier run, but nothing else
+		if (unlink_socket(addr) == -1)
+		{
+			free(ms);
+			return NULL;
+		}
+
+		ms->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (ms->fd == -1 || bind(ms->fd, (struct sockaddr *) &sun, sizeof(sun)) == -1)
+		{
+			goto error;
+		}
+		ms->path = addr;            // ours now, to be removed when done
+	}
+	else
+	{
+		char host[256] = "127.0.0.1";
+		char const *port = strrchr(addr, ':');
+		if (port)
+		{
+			snprintf(host, sizeof(host), "%.*s", (int) (port - addr), addr);
+			port++;
+		}
+		else
+		{
+			port = addr;
+		}
+
+		struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+		struct addrinfo *info = NULL;
+		if (getaddrinfo(host, port, &hints, &info) != 0)
+		{
+			free(ms);
+			return NULL;
+		}
+
+		int one = 1;
+		ms->fd = socket(info->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (ms->fd == -1 ||
+				setsockopt(ms->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+				bind(ms->fd, info->ai_addr, info->ai_addrlen) == -1)
+		{
+			freeaddrinfo(info);
+			goto error;
+		}
+		freeaddrinfo(info);
+	}
+
+	if (listen(ms->fd, METRICS_MAX_CLIENTS) == -1)
+	{
+		goto error;
+	}
+
+	return ms;
+
+error:
+	if (ms->fd != -1)
+	{
+		close(ms->fd);
+	}
+	if (ms->path)
+	{
+		unlink(ms->path);
+	}
+	free(ms);
+	return NULL;
+}
+
+static void
+metrics_close(metrics_server_s *ms)
+{
+	for (int i = 0; i < METRICS_MAX_CLIENTS; ++i)
+	{
+		if (ms->clients[i] != -1)
+		{
+			close(ms->clients[i]);
+		}
+	}
+	close(ms->fd);
+	if (ms->path)
+	{
+		unlink(ms->path);
+	}
+	free(ms);
+}
+
+/*
+ * Appends a histogram in Prometheus' text format to sb, summing up the 
+ * histogram at offset off of all metrics blocks.
+ */
+static void
+metrics_histogram(strbuf_s *sb, char const *name, char const *help, size_t off, int threads)
+{
+	uint64_t buckets[METRICS_BUCKETS + 1] = { 0 };
+	uint64_t sum = 0;
+
+	for (int t = 0; t < threads; ++t)
+	{
+		histogram_s *hist = (histogram_s *) ((char *) &metrics_blocks[t] + off);
+		for (size_t b = 0; b <= METRICS_BUCKETS; ++b)
+		{
+			buckets[b] += atomic_load_explicit(&hist->buckets[b], memory_order_relaxed);
+		}
+		sum += atomic_load_explicit(&hist->sum, memory_order_relaxed);
+	}
+
+	// Prometheus' buckets are cumulative
+	uint64_t count = 0;
+	sb_printf(sb, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (size_t b = 0; b < METRICS_BUCKETS; ++b)
+	{
+		count += buckets[b];
+		sb_printf(sb, "%s_bucket{le=\"%g\"} %" PRIu64 "\n", name, metrics_bounds[b] / 1e9, count);
+	}
+	count += buckets[METRICS_BUCKETS];
+	sb_printf(sb, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, count);
+	sb_printf(sb, "%s_sum %.9f\n%s_count %" PRIu64 "\n", name, sum / 1e9, name, count);
+}
+
+/*
+ * Renders all metrics in Prometheus' text format into sb.
+ */
+static void
+metrics_render(state_s *state, strbuf_s *sb)
+{
+	int threads = atomic_load_explicit(&metrics_threads, memory_order_relaxed);
+	threads = threads > METRICS_MAX_THREADS ? METRICS_MAX_THREADS : threads;
+
+	uint64_t messages = 0;
+	uint64_t bytes = 0;
+	uint64_t disconnects = 0;
+	for (int t = 0; t < threads; ++t)
+	{
+		messages += atomic_load_explicit(&metrics_blocks[t].messages, memory_order_relaxed);
+		bytes += atomic_load_explicit(&metrics_blocks[t].bytes, memory_order_relaxed);
+		disconnects += atomic_load_explicit(&metrics_blocks[t].disconnects, memory_order_relaxed);
+	}
+
+	sb_printf(sb, "# HELP lurp_messages_total Chat messages processed.\n");
+	sb_printf(sb, "# TYPE lurp_messages_total counter\n");
+	sb_printf(sb, "lurp_messages_total{channel=\"%s\"} %" PRIu64 "\n", 
+			state->opts->chan ? state->opts->chan : "", messages);
+
+	sb_printf(sb, "# HELP lurp_bytes_written_total Bytes of chat output written to stdout.\n");
+	sb_printf(sb, "# TYPE lurp_bytes_written_total counter\n");
+	sb_printf(sb, "lurp_bytes_written_total %" PRIu64 "\n", bytes);
+
+	sb_printf(sb, "# HELP lurp_disconnects_total Disconnects from the chat server.\n");
+	sb_printf(sb, "# TYPE lurp_disconnects_total counter\n");
+	sb_printf(sb, "lurp_disconnects_total %" PRIu64 "\n", disconnects);
+
+	sb_printf(sb, "# HELP lurp_dropped_messages_total Chat messages dropped.\n");
+	sb_printf(sb, "# TYPE lurp_dropped_messages_total counter\n");
+	sb_printf(sb, "lurp_dropped_messages_total{reason=\"sampling\"} %" PRIu64 "\n", 
+			state->sampler ? state->sampler->dropped : 0);
+
+	sb_printf(sb, "# HELP lurp_fanout_clients_dropped_total Fan-out clients dropped for being too slow.\n");
+	sb_printf(sb, "# TYPE lurp_fanout_clients_dropped_total counter\n");
+	sb_printf(sb, "lurp_fanout_clients_dropped_total %" PRIu64 "\n", 
+			state->fanout ? state->fanout->dropped : 0);
+
+	metrics_histogram(sb, "lurp_render_seconds", "Time spent processing a chat message.",
+			offsetof(metrics_s, render), threads);
+	metrics_histogram(sb, "lurp_tick_seconds", "Time spent processing messages per twirc_tick(), from the first message on.",
+			offsetof(metrics_s, tick), threads);
+}
+
+/*
+ * Accepts scrapes and answers those that have sent their request. Scrapers 
+ * that don't send one within METRICS_TIMEOUT get disconnected, as does the 
+ * one waiting the longest when a new one comes in and all slots are taken. 
+ * Should be called regularly, for example after every twirc_tick().
+ */
+static void
+metrics_service(metrics_server_s *ms, state_s *state)
+{
+	int fd;
+	uint64_t now = now_ns();
+	while ((fd = accept4(ms->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		// Take a free slot or, if there is none, the one waiting the longest
+		int i = 0;
+		for (int j = 1; j < METRICS_MAX_CLIENTS && ms->clients[i] != -1; ++j)
+		{
+			if (ms->clients[j] == -1 || ms->since[j] < ms->since[i])
+			{
+				i = j;
+			}
+		}
+		if (ms->clients[i] != -1)
+		{
+			close(ms->clients[i]);
+		}
+		ms->clients[i] = fd;
+		ms->since[i] = now;
+	}
+
+	for (int i = 0; i < METRICS_MAX_CLIENTS; ++i)
+	{
+		if (ms->clients[i] == -1)
+		{
+			continue;
+		}
+
+		// We don't care about the request, as long as there is one
+		char req[1024];
+		ssize_t n = recv(ms->clients[i], req, sizeof(req), 0);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+				now - ms->since[i] < (uint64_t) METRICS_TIMEOUT * 1000000)
+		{
+			continue;
+		}
+
+		if (n > 0)
+		{
+			strbuf_s body = { .buf = ms->body, .size = METRICS_BUFFER };
+			metrics_render(state, &body);
+
+			char head[256];
+			int len = snprintf(head, sizeof(head),
+					"HTTP/1.0 200 OK\r\n"
+					"Content-Type: text/plain; version=0.0.4\r\n"
+					"Content-Length: %zu\r\n"
+					"Connection: close\r\n\r\n", body.len);
+
+			// The response is small enough for the socket's send buffer
+			send(ms->clients[i], head, len, MSG_NOSIGNAL);
+			send(ms->clients[i], body.buf, body.len, MSG_NOSIGNAL);
+		}
+
+		close(ms->clients[i]);
+		ms->clients[i] = -1;
+	}
+}
+
+/*
+ * Grows the archive's index, services fan-out clients (waiting for those that
+ * are more than lag messages behind) and answers metrics scrapes during 
+ * playback, all of which happens after every twirc_tick() when live.
+ */
+static void
+playback_service(state_s *state, uint64_t lag)
+{
+	if (state->archive && archive_reserve(state->archive) == -1)
+	{
+		fputs("*** Error growing archive index\n", stderr);
+	}
+	if (state->fanout)
+	{
+		fanout_wait(state->fanout, lag);
+	}
+	if (state->metrics)
+	{
+		metrics_service(state->metrics, state);
+	}
+}
+
+/*
+ * Maps the archive at path into memory and prints all messages between the
+ * timestamps from and to (ms, inclusive) the same way live messages would be
+ * printed. Only the dictionary gets loaded up front; the first block to look
+ * at is found via binary search over the index. Archives without index get 
+ * read from the start. Returns 0 on success, -1 on error (file not found, not
+ * an archive, corrupt archive).
+ */
+static int
+archive_play(state_s *state, char const *path, uint64_t from, uint64_t to)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < ARCHIVE_HEAD_SIZE + ARCHIVE_FOOT_SIZE)
+	{
+		close(fd);
+		return -1;
+	}
+
+	size_t size = st.st_size;
+	unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	int err = -1;
+	char **dict = NULL;
+	char *pool = NULL;
+	char *chan = state->opts->chan;
+
+	// Validate the header
+	size_t block_size = map[8] | (map[9] << 8);
+	if (memcmp(map, ARCHIVE_MAGIC, 8) || block_size != ARCHIVE_BLOCK_SIZE)
+	{
+		goto done;
+	}
+
+	unsigned char const *foot = map + size - ARCHIVE_FOOT_SIZE;
+	unsigned char const *index = NULL;
+	size_t blocks = 0;
+	int64_t count;
+
+	// Without footer, the writer didn't get to finish the archive
+	if (memcmp(foot, ARCHIVE_FOOT_MAGIC, 8))
+	{
+		fputs("*** Archive has no index, reading all of it\n", stderr);
+		if ((count = archive_scan(map, size, &blocks, &dict, &pool)) == -1)
+		{
+			goto done;
+		}
+	}
+	else if ((count = archive_load(map, size, &blocks, &index, &dict, &pool)) == -1)
+	{
+		goto done;
+	}
+
+	// Find the last block that starts before from; blocks often start with 
+	// the same timestamp the previous one ended with, so the ones starting 
+	// at from might not have all of its messages
+	size_t lo = 0;
+	size_t hi = index ? blocks : 0;
+	while (hi - lo > 1)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (get_u64(index + mid * 8) < from)
+		{
+			lo = mid;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	char msg[ARCHIVE_BLOCK_SIZE];
+	size_t played = 0;
+	for (size_t b = lo; b < blocks && running; ++b)
+	{
+		unsigned char const *p = map + ARCHIVE_HEAD_SIZE + b * ARCHIVE_BLOCK_SIZE;
+		unsigned char const *end = p;
+		uint64_t ts = get_u64(p);
+		size_t records = archive_block(p, &end);
+
+		p += ARCHIVE_BLOCK_HEAD;
+		for (size_t r = 0; r < records; ++r)
+		{
+			archive_record_s rec;
+			char id[UUID_BUFFER] = { 0 };
+
+			if (archive_read(&p, end, &rec) == -1)
+			{
+				goto done;
+			}
+			for (int i = 0; i < 5; ++i)
+			{
+				if (rec.ids[i] > (uint64_t) count)
+				{
+					goto done;
+				}
+			}
+			ts += rec.delta;
+
+			if (rec.flags & ARCHIVE_FLAG_DICT || ts < from)
+			{
+				continue;
+			}
+			if (ts > to)
+			{
+				err = 0;
+				goto done;
+			}
+
+			if (rec.id)
+			{
+				uuid_format(rec.id, id);
+			}
+			memcpy(msg, rec.str, rec.len);
+			msg[rec.len] = '\0';
+
+			message_s m = {
+				.ts     = ts,
+				.nick   = rec.ids[0] ? dict[rec.ids[0]] : "",
+				.dname  = dict[rec.ids[1]],
+				.color  = dict[rec.ids[2]],
+				.badges = dict[rec.ids[3]],
+				.chan   = dict[rec.ids[4]],
+				.id     = id,
+				.text   = msg,
+				.action = (rec.flags & ARCHIVE_FLAG_ACTION) != 0,
+				.tombstone = (rec.flags & ARCHIVE_FLAG_TOMBSTONE) != 0,
+				.notice = (rec.flags & ARCHIVE_FLAG_NOTICE) != 0
+			};
+
+			// The metrics are labeled with the channel, as if we were live
+			if (chan == NULL && rec.ids[4])
+			{
+				state->opts->chan = dict[rec.ids[4]];
+			}
+			// Every now and then, take care of what might allocate or wait; 
+			// this way, no client falls behind far enough to get dropped
+			if (++played % (FANOUT_RING / 4) == 0)
+			{
+				playback_service(state, FANOUT_RING / 2);
+			}
+			process_message(state, ts / 1000, &m);
+		}
+	}
+	err = 0;
+
+done:
+	// Let the clients catch up with the last messages
+	playback_service(state, 0);
+
+	state->opts->chan = chan;
+	free(dict);
+	free(pool);
+	munmap(map, size);
+	return err;
+}
+
+/*
+ * Sampling
+ *
+ * For giant channels, we can keep only a fraction of the chatters, chosen by 
+ * a hash of their user id. As the same chatters get kept for as long as the
+ * fraction stays the same, whole conversations remain intact. Additionally,
+ * the fraction can be adjusted once per second to stay within a budget of 
+ * messages per second. Lowering the fraction only ever drops chatters that
+ * have the highest hashes, hence the ones that remain are still the same.
+ */
+
+/*
+ * Sets the fraction of chatters to keep.
+ */
+static void
+sampler_set(sampler_s *smp, double fraction)
+{
+	smp->fraction = fraction;
+	smp->threshold = fraction >= 1.0 ? UINT32_MAX : (uint32_t) (fraction * UINT32_MAX);
+}
+
+static void
+sampler_init(sampler_s *smp, double fraction, unsigned budget)
+{
+	memset(smp, 0, sizeof(sampler_s));
+	smp->max = fraction;
+	smp->budget = budget;
+	smp->window = now_ms();
+	sampler_set(smp, fraction);
+}
+
+/*
+ * Decides whether to keep the event's message, based on the "user-id" tag 
+ * (or the user name, if there is none). This is the only tag we look at for
+ * messages that get dropped. Returns 1 if the message should be kept.
+ */
+static int
+sampler_keep(sampler_s *smp, twirc_event_t *evt)
+{
+	char const *id = twirc_get_tag_value(evt->tags, "user-id");
+	if (empty(id))
+	{
+		id = evt->origin ? evt->origin : "";
+	}
+
+	// FNV-1a alone doesn't spread short numeric strings well enough, 
+	// so we put the result through MurmurHash3's finalizer
+	uint32_t h = fnv1a(id);
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	if (h > smp->threshold)
+	{
+		smp->dropped++;
+		return 0;
+	}
+
+	smp->kept++;
+	return 1;
+}
+
+/*
+ * Adjusts the fraction to the message budget once per second. Should be 
+ * called regularly, for example after every twirc_tick().
+ */
+static void
+sampler_update(sampler_s *smp)
+{
+	uint64_t now = now_ms();
+	if (smp->budget == 0 || now - smp->window < 1000)
+	{
+		return;
+	}
+
+	// Messages per second in the last window
+	double rate = smp->kept * 1000.0 / (now - smp->window);
+
+	// Move towards the budget, but at most by a factor of 2 per second
+	double factor = rate > 0 ? smp->budget / rate : 2.0;
+	factor = factor > 2.0 ? 2.0 : (factor < 0.5 ? 0.5 : factor);
+
+	double fraction = smp->fraction * factor;
+	fraction = fraction > smp->max ? smp->max : fraction;
+	fraction = fraction < SAMPLE_MIN ? SAMPLE_MIN : fraction;
+	sampler_set(smp, fraction);
+
+	smp->window = now;
+	smp->kept = 0;
+}
+
+/*
+ * Called once the connection has been established. This does not mean we're
+ * authenticated yet, hence we should not attempt to join channels yet etc.
+ */
+static void
+handle_connect(twirc_state_t *s, twirc_event_t *evt)
+{
+	print_status(twirc_get_context(s), "*** Connected");
+}
+
+/*
+ * Called once we're authenticated. This is where we can join channels etc.
+ */
+static void
+handle_welcome(twirc_state_t *s, twirc_event_t *evt)
+{
+	state_s *state = twirc_get_context(s);
+	print_status(state, "*** Authenticated");
+
+	// Let's join the specified channel
+	twirc_cmd_join(s, state->opts->chan);
+}
+
+/*
+ * Called once we see a user join a channel we're in. This also fires for when
+ * we join a channel, in which case 'evt->origin' will be our own username.
+ */
+static void
+handle_join(twirc_state_t *s, twirc_event_t *evt)
+{
+	twirc_login_t *login = twirc_get_login(s);
+
+	if (!evt->origin)
+	{
+		return;
+	}
+	if (!login->nick)
+	{
+		return;
+	}
+	if (strcmp(evt->origin, login->nick) != 0)
+	{
+		return;
+	}
+
+	char buf[TWIRC_NICK_SIZE + 16];
+	snprintf(buf, sizeof(buf), "*** Joined %s", evt->channel);
+	print_status(twirc_get_context(s), buf);
+}
+
+/*
+ * Builds a message from a PRIVMSG, ACTION or USERNOTICE event, sent by nick, 
+ * and processes it.
+ */
+static void
+process_event(state_s *state, twirc_event_t *evt, char const *nick)
+{
+	options_s *opts = state->opts;
+
+	char const *color  = twirc_get_tag_value(evt->tags, "color");
+	char const *badges = twirc_get_tag_value(evt->tags, "badges");
+	char const *dname  = twirc_get_tag_value(evt->tags, "display-name");
+	char const *tmits  = twirc_get_tag_value(evt->tags, "tmi-sent-ts");
+
+	message_s m = {
+		.ts     = empty(tmits) ? now_ms() : strtoull(tmits, NULL, 10),
+		.chan   = evt->channel,
+		.nick   = nick,
+		.dname  = dname,
+		.color  = color,
+		.badges = badges,
+		.id     = twirc_get_tag_value(evt->tags, "id"),
+		.raw    = evt->raw,
+		.text   = evt->message,
+		.action = evt->ctcp != NULL
+	};
+
+	int ts = opts->twitchtime ? m.ts / 1000 : 0;
+	process_message(state, ts, &m);
+}
+
+static void
+handle_message(twirc_state_t *s, twirc_event_t *evt)
+{
+	state_s *state = twirc_get_context(s);
+
+	// Drop sampled out messages before doing anything else
+	if (state->sampler && !sampler_keep(state->sampler, evt))
+	{
+		return;
+	}
+
+	process_event(state, evt, evt->origin);
+}
+
+/*
+ * Builds a notice with the given text from a USERNOTICE or ROOMSTATE event, 
+ * caused by nick (if any), and processes it. Its text might get modified.
+ */
+static void
+process_notice(state_s *state, twirc_event_t *evt, char const *nick, char *text)
+{
+	char const *tmits = twirc_get_tag_value(evt->tags, "tmi-sent-ts");
+
+	message_s m = {
+		.ts     = empty(tmits) ? now_ms() : strtoull(tmits, NULL, 10),
+		.chan   = evt->channel,
+		.nick   = nick,
+		.dname  = twirc_get_tag_value(evt->tags, "display-name"),
+		.color  = twirc_get_tag_value(evt->tags, "color"),
+		.badges = twirc_get_tag_value(evt->tags, "badges"),
+		.raw    = evt->raw,
+		.text   = text,
+		.notice = 1
+	};
+
+	process_message(state, state->opts->twitchtime ? m.ts / 1000 : 0, &m);
+}
+
+/*
+ * Called for subs, gifted subs, raids and the like. Twitch describes these in
+ * the "system-msg" tag, which we process as a notice; if the user added a
+ * message of their own, it gets processed like any other chat message.
+ */
+static void
+handle_usernotice(twirc_state_t *s, twirc_event_t *evt)
+{
+	state_s *state = twirc_get_context(s);
+
+	if (state->sampler && !sampler_keep(state->sampler, evt))
+	{
+		return;
+	}
+
+	char const *sysmsg = twirc_get_tag_value(evt->tags, "system-msg");
+	if (!empty(sysmsg))
+	{
+		char buf[SCREEN_TEXT_SIZE];
+		snprintf(buf, sizeof(buf), "%s", sysmsg);
+		process_notice(state, evt, twirc_get_tag_value(evt->tags, "login"), buf);
+	}
+
+	if (!empty(evt->message))
+	{
+		process_event(state, evt, twirc_get_tag_value(evt->tags, "login"));
+	}
+}
+
+/*
+ * Processes a tombstone for the message with the given id or, if there is
+ * no id, for all messages by nick or, if there is no nick either, for all
+ * messages. Tombstones are never sampled out, as they are cheap and might
+ * refer to messages from before the sampling fraction went down.
+ */
+static void
+process_tombstone(state_s *state, twirc_event_t *evt, char const *nick, char const *id)
+{
+	char const *tmits = twirc_get_tag_value(evt->tags, "tmi-sent-ts");
+	char text[] = "";
+
+	message_s m = {
+		.ts        = empty(tmits) ? now_ms() : strtoull(tmits, NULL, 10),
+		.chan      = evt->channel,
+		.nick      = nick,
+		.id        = id,
+		.raw       = evt->raw,
+		.text      = text,
+		.tombstone = 1
+	};
+
+	process_message(state, state->opts->twitchtime ? m.ts / 1000 : 0, &m);
+}
+
+/*
+ * Called when a moderator clears the chat or, in case of a timeout or ban,
+ * all messages of the user given as target.
+ */
+static void
+handle_clearchat(twirc_state_t *s, twirc_event_t *evt)
+{
+	process_tombstone(twirc_get_context(s), evt, evt->target, NULL);
+}
+
+/*
+ * Called when a moderator deletes a single message.
+ */
+static void
+handle_clearmsg(twirc_state_t *s, twirc_event_t *evt)
+{
+	process_tombstone(twirc_get_context(s), evt, 
+			twirc_get_tag_value(evt->tags, "login"),
+			twirc_get_tag_value(evt->tags, "target-msg-id"));
+}
+
+/*
+ * Called when joining a channel, with all of its chat settings, and whenever
+ * one of them changes, with just that one. Processes them as a notice.
+ */
+static void
+handle_roomstate(twirc_state_t *s, twirc_event_t *evt)
+{
+	//                          .-- value that means off
+	//                          |      .-- unit of other values, if any
+	//                          |      |
+	char const *modes[][3] = {
+		{ "emote-only",     "0",  NULL  },
+		{ "followers-only", "-1", "min" },
+		{ "r9k",            "0",  NULL  },
+		{ "slow",           "0",  "s"   },
+		{ "subs-only",      "0",  NULL  }
+	};
+
+	char buf[256];
+	strbuf_s sb = { .buf = buf, .size = sizeof(buf) };
+	sb_printf(&sb, "Chat settings:");
+	size_t found = 0;
+
+	for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+	{
+		char const *val = twirc_get_tag_value(evt->tags, modes[i][0]);
+		if (empty(val))
+		{
+			continue;
+		}
+
+		int off = strcmp(val, modes[i][1]) == 0;
+		char const *unit = modes[i][2];
+		// Settings with odd values that don't fit are left out
+		sb_printf(&sb, "%s %s %s%s", found++ ? "," : "",
+				modes[i][0], off ? "off" : (unit ? val : "on"), off || !unit ? "" : unit);
+	}
+
+	if (found)
+	{
+		process_notice(twirc_get_context(s), evt, NULL, buf);
+	}
+}
+
+/*
+ * Called when a loss of connection has been detected. This could be due to 
+ * a connection error or because Twitch closed the connection on us.
+ */
+static void
+handle_disconnect(twirc_state_t *s, twirc_event_t *evt)
+{
+	print_status(twirc_get_context(s), "*** Disconnected");
+	counter_add(&metrics_local()->disconnects, 1);
+	running = 0;
+}
+
+/*
+ * Handle signals. 
+ */
+static void
+on_signal(int sig)
+{
+	switch (sig)
+	{
+		case SIGWINCH:
+			resized = 1;
+			break;
+		case SIGINT:
+		case SIGTERM:
+		case SIGQUIT:
+			running = 0;
+			break;
+	}
+}
+
+/**
+ * Prints the program's name and version number.
+ */
+static void
+version()
+{
+	fprintf(stdout, "%s %d.%d.%d\n%s\n",
+			PROJECT_NAME,
+			VERSION_MAJOR,
+		       	VERSION_MINOR,
+			VERSION_PATCH,
+			PROJECT_URL);
+}
+
+/**
+ * Prints usage information.
+ */
+static void
+help(char *invocation, FILE *where)
+{
+	fprintf(where, "Usage:\n");
+	fprintf(where, "\t%s -c CHANNEL [OPTIONS...]\n", invocation);
+	fprintf(where, "\t%s -p FILE [OPTIONS...]\n", invocation);
+	fprintf(where, "\tNote: the channel should start with '#' and be all lower-case.\n");
+	fprintf(where, "\n");
+	fprintf(where, "Options:\n");
+	fprintf(where, "\t-a Neatly align (left-pad) usernames and messages.\n");
+	fprintf(where, "\t-b Mark subscribers and mods with + and @ respectively.\n");
+	fprintf(where, "\t-B TIME Only play back messages sent at or after TIME (unix time).\n");
+	fprintf(where, "\t-d Use display names instead of user names where available.\n");
+	fprintf(where, "\t-E TIME Only play back messages sent at or before TIME (unix time).\n");
+	fprintf(where, "\t-f FORMAT Print messages according to FORMAT, see below.\n");
+	fprintf(where, "\t-F Full-screen mode, for channels with very high message rates.\n");
+	fprintf(where, "\t-h Print this help text and exit.\n");
+	fprintf(where, "\t-L RATE Adjust the sampling to print at most RATE messages per second.\n");
+	fprintf(where, "\t-m MODE Set the color mode: 'true', '8bit', '4bit', '2bit' or 'mono'.\n");
+	fprintf(where, "\t-M NAME Publish all messages to the shared memory ring NAME.\n");
+	fprintf(where, "\t-p FILE Print the messages stored in the archive FILE and exit.\n");
+	fprintf(where, "\t-r Use the server-supplied timestamp instead of the local time.\n");
+	fprintf(where, "\t-s Print additional status information to stderr.\n");
+	fprintf(where, "\t-S FRACTION Only keep messages of this fraction (0-1, excluding 0) of chatters.\n");
+	fprintf(where, "\t-t FORMAT Enable timestamps, using the specified format.\n");
+	fprintf(where, "\t-u PATH Serve all messages to local clients via the Unix domain socket PATH.\n");
+	fprintf(where, "\t-V Print version information and exit.\n");
+	fprintf(where, "\t-w FILE Also write all messages to the archive FILE.\n");
+	fprintf(where, "\t-x ADDR Serve metrics on ADDR: a port, HOST:PORT or a socket path.\n");
+	fprintf(where, "\n");
+	fprintf(where, "Format fields:\n");
+	fprintf(where, "\t%%t timestamp, %%b badge, %%n nick, %%m message, %%c channel, %%i message id, %%%% literal %%\n");
+}
+
+/*
+ * Tries to determine the terminal's color capabilities by looking at the 
+ * TERM and COLORTERM environment variables and, based on this, returns an
+ * educated guess as to which is the highest supported color mode. In case
+ * no hints to the color mode can be found in either variable, this function
+ * errors on the safe side and returns COLOR_MODE_MONO.
+ */
+static uint8_t
+detect_color_mode()
+{
+	// Don't output colors if we're not talking to a terminal
+	if (!isatty(fileno(stdout)))
+	{
+		return COLOR_MODE_MONO; 
 	}
-	
-	// Attempt to detect color mode (errs on safe side)
-	if (opts.colormode == COLOR_MODE_NONE)
+
+	// Check terminal name for suffix '-m' or '-256'
+	char *term  = getenv("TERM");
+	if (term && strstr(term, "-m\0"))
 	{
-		opts.colormode = detect_color_mode();
+		// -m = Monochrome, no colors
+		return COLOR_MODE_MONO;
+	}
+	if (term && strstr(term, "-m-"))
+	{
+		return COLOR_MODE_MONO;
+	}
+	if (term && strstr(term, "-8c"))
+	{
+		return COLOR_MODE_2BIT;
+	}
+	if (term && strstr(term, "-16c"))
+	{
+		return COLOR_MODE_4BIT;
+	}
+	if (term && strstr(term, "-256"))
+	{
+		return COLOR_MODE_8BIT;
 	}
-	
-	// Set stdout to line buffered
-	setlinebuf(stdout);
 
-	// Make sure we still do clean-up on SIGINT (ctrl+c)
-	// and similar signals that indicate we should quit.
-	struct sigaction sa = { .sa_handler = &on_signal };
-	
-	// These might return -1 on error, but we'll ignore that for now
-	sigaction(SIGINT,   &sa, NULL);
-	sigaction(SIGQUIT,  &sa, NULL);
-	sigaction(SIGTERM,  &sa, NULL);
-	sigaction(SIGWINCH, &sa, NULL);
+	// Check COLORTERM env var for 'truecolor' or '24bit'
+	// https://gist.github.com/XVilka/8346728
+	char *cterm = getenv("COLORTERM");
+	if (cterm && strstr(cterm, "truecolor"))
+	{
+		return COLOR_MODE_TRUE;
+	}
+	if (cterm && strstr(cterm, "24bit"))
+	{
+		return COLOR_MODE_TRUE;
+	}
+
+	return COLOR_MODE_MONO;
+}
+
+/*
+ * Opens the archive, starts the fan-out server, creates the shared-memory 
+ * ring and starts the metrics endpoint, as far as requested by the options. 
+ * Returns 0 on success, -1 on error (outputs opened up to that point should 
+ * still be closed).
+ */
+static int
+outputs_open(state_s *state)
+{
+	options_s *opts = state->opts;
+
+	// Open the archive, if requested
+	if (opts->archive && (state->archive = archive_open(opts->archive)) == NULL)
+	{
+		fprintf(stderr, "Error creating archive %s\n", opts->archive);
+		return -1;
+	}
+
+	// Start the fan-out server, if requested
+	if (opts->socket && (state->fanout = fanout_open(opts->socket)) == NULL)
+	{
+		fprintf(stderr, "Error creating socket %s: %s\n", opts->socket, strerror(errno));
+		return -1;
+	}
+
+	// Create the shared-memory ring, if requested
+	if (opts->shm && (state->ring = shm_ring_open(opts->shm)) == NULL)
+	{
+		fprintf(stderr, "Error creating shared memory ring %s\n", opts->shm);
+		return -1;
+	}
+
+	// Start serving metrics, if requested
+	if (opts->metrics && (state->metrics = metrics_open(opts->metrics)) == NULL)
+	{
+		fprintf(stderr, "Error serving metrics on %s\n", opts->metrics);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Closes all outputs opened by outputs_open(). 
+ * Returns 0 on success, -1 if finalizing the archive failed.
+ */
+static int
+outputs_close(state_s *state)
+{
+	int err = 0;
+
+	if (state->fanout)
+	{
+		fanout_close(state->fanout);
+		state->fanout = NULL;
+	}
+
+	if (state->ring)
+	{
+		shm_ring_close(state->ring);
+		state->ring = NULL;
+	}
+
+	if (state->metrics)
+	{
+		metrics_close(state->metrics);
+		state->metrics = NULL;
+	}
+
+	if (state->archive && archive_close(state->archive) == -1)
+	{
+		fprintf(stderr, "Error finalizing archive %s\n", state->opts->archive);
+		err = -1;
+	}
+	state->archive = NULL;
+
+	return err;
+}
+
+/*
+ * Calls twirc_tick(). If metrics are enabled and messages came in, records 
+ * the time from the first message to twirc_tick() returning, which leaves 
+ * out the time spent waiting for data.
+ */
+static int
+tick(state_s *state, twirc_state_t *s, int timeout)
+{
+	ALLOC_STATS_TICK(1);
+
+	if (state->metrics == NULL)
+	{
+		int ret = twirc_tick(s, timeout);
+		ALLOC_STATS_TICK(0);
+		return ret;
+	}
+
+	state->tick_busy = 0;
+	int ret = twirc_tick(s, timeout);
+	if (state->tick_busy)
+	{
+		histogram_observe(&metrics_local()->tick, now_ns() - state->tick_busy);
+	}
+
+	ALLOC_STATS_TICK(0);
+	return ret;
+}
+
+/*
+ * Connects to Twitch and processes messages until we get disconnected or
+ * asked to quit. Returns 0 on success, -1 on error.
+ */
+static int
+run(state_s *state)
+{
+	options_s *opts = state->opts;
 
-	// Get the terminal size
-	if (term_size(&(opts.term_width), &(opts.term_height)) == -1)
+	// Get the terminal size; without a terminal (for example when running as 
+	// a service that only serves clients), we go without, as for playback
+	int tty = term_size(&(opts->term_width), &(opts->term_height)) == 0;
+	if (!tty && opts->fullscreen)
 	{
 		fputs("Could not determine terminal size\n", stderr);
-		return EXIT_FAILURE;
+		return -1;
 	}
 	
 	// Create libtwirc state instance
@@ -811,11 +4687,11 @@ main(int argc, char **argv)
 	if (s == NULL)
 	{
 		fputs("Error initializing libtwirc\n", stderr);
-		return EXIT_FAILURE;
+		return -1;
 	}
 	
 	// Save the metadata in the state
-	twirc_set_context(s, &opts);
+	twirc_set_context(s, state);
 
 	// We get the callback struct from the libtwirc state
 	twirc_callbacks_t *cbs = twirc_get_callbacks(s);
@@ -826,16 +4702,50 @@ main(int argc, char **argv)
 	cbs->join            = handle_join;
 	cbs->action          = handle_message;
 	cbs->privmsg         = handle_message;
+	cbs->usernotice      = handle_usernotice;
+	cbs->clearchat       = handle_clearchat;
+	cbs->clearmsg        = handle_clearmsg;
+	cbs->roomstate       = handle_roomstate;
 	cbs->disconnect      = handle_disconnect;
 
-	term_setup();
-	fputs("*** Connecting ...\n", stdout);
+	if (tty)
+	{
+		term_setup();
+	}
+
+	// In full-screen mode, we paint the screen ourselves
+	if (opts->fullscreen)
+	{
+		// wcwidth() needs to know the terminal's character set
+		setlocale(LC_CTYPE, "");
+
+		state->screen = screen_init(opts->colormode, opts->term_width, opts->term_height);
+		if (state->screen == NULL)
+		{
+			fputs("Error initializing screen\n", stderr);
+			twirc_kill(s);
+			term_reset();  // tty is given in full-screen mode
+			return -1;
+		}
+	}
+
+	print_status(state, "*** Connecting ...");
 	
 	// Connect to the IRC server
 	if (twirc_connect_anon(s, DEFAULT_HOST, DEFAULT_PORT) != 0)
 	{
+		if (state->screen)
+		{
+			screen_free(state->screen);
+			state->screen = NULL;
+		}
+		twirc_kill(s);
+		if (tty)
+		{
+			term_reset();
+		}
 		fputs("*** Connection failed!\n", stdout);
-		return EXIT_FAILURE;
+		return -1;
 	}
 
 	// Main loop - we call twirc_tick() every go-around, as that's what 
@@ -844,23 +4754,196 @@ main(int argc, char **argv)
 	// it 1 second to wait for and process IRC messages, then it will hand 
 	// control back to us. If twirc_tick() detects a disconnect or error,
 	// it will return -1, otherwise it will return 0 and we can go on!
+	// When serving clients, we want to get control back more often. In 
+	// full-screen mode, we might need control back sooner than that, 
+	// namely when the next frame is due.
+
+	int timeout = (state->fanout || state->metrics) ? SERVICE_TICK : 1000;
+	int wait = timeout;
 
 	running = 1;
-	while (twirc_tick(s, 1000) == 0 && running == 1)
+	while (tick(state, s, wait) == 0 && running == 1)
 	{
 		// If we caught a window resize signal, fetch the new size
 		if (resized)
 		{
-			term_size(&(opts.term_width), &(opts.term_height));
+			term_size(&(opts->term_width), &(opts->term_height));
 			resized = 0;
+
+			if (state->screen && screen_resize(state->screen, opts->term_width, opts->term_height) == -1)
+			{
+				running = 0;
+			}
+		}
+
+		// Make sure the archive's index never needs to grow mid-message
+		if (state->archive && archive_reserve(state->archive) == -1)
+		{
+			fputs("*** Error growing archive index\n", stderr);
+		}
+
+		// Take care of new and slow fan-out clients
+		if (state->fanout)
+		{
+			fanout_service(state->fanout);
+		}
+
+		// Adjust the sampling rate to the budget
+		if (state->sampler)
+		{
+			sampler_update(state->sampler);
+		}
+
+		// Answer metrics scrapes
+		if (state->metrics)
+		{
+			metrics_service(state->metrics, state);
+		}
+
+		// Paint a frame if one is due
+		if (state->screen)
+		{
+			wait = screen_update(state->screen, timeout);
 		}
 	}
 
+	if (state->screen)
+	{
+		screen_free(state->screen);
+		state->screen = NULL;
+	}
+
 	fprintf(stdout, "*** Quit (%d)\n", twirc_get_last_error(s));
 
 	twirc_kill(s); // disconnect and free the twirc state
-	term_reset();  // put the terminal back in normal operation
+	if (tty)
+	{
+		term_reset();  // put the terminal back in normal operation
+	}
 
-	return EXIT_SUCCESS;
+	return 0;
 }
 
+/*
+ * Main - this is where we make things happen!
+ */
+int
+main(int argc, char **argv)
+{
+	// Parse command line arguments
+	options_s opts = { 0 };
+	parse_args(argc, argv, &opts);
+
+	if (opts.help)
+	{
+		help(argv[0], stdout);
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.version)
+	{
+		version();
+		return EXIT_SUCCESS;
+	}
+	
+	// Abort if no channel name (or archive to play back) was given	
+	if (opts.chan == NULL && opts.playback == NULL)
+	{
+		help(argv[0], stderr);
+		return EXIT_FAILURE;
+	}
+	
+	// Attempt to detect color mode (errs on safe side)
+	if (opts.colormode == COLOR_MODE_NONE)
+	{
+		opts.colormode = detect_color_mode();
+	}
+	
+	// Set stdout to line buffered
+	setlinebuf(stdout);
+
+	// Load the time zone once, see timestamp_str()
+	tzset();
+
+	// Make sure we still do clean-up on SIGINT (ctrl+c)
+	// and similar signals that indicate we should quit.
+	struct sigaction sa = { .sa_handler = &on_signal };
+	
+	// These might return -1 on error, but we'll ignore that for now
+	sigaction(SIGINT,   &sa, NULL);
+	sigaction(SIGQUIT,  &sa, NULL);
+	sigaction(SIGTERM,  &sa, NULL);
+	sigaction(SIGWINCH, &sa, NULL);
+
+	state_s state = { .opts = &opts };
+
+	// Compile the format string, if given
+	render_plan_s plan;
+	if (opts.format)
+	{
+		if (render_plan_compile(&plan, opts.format, &opts) == -1)
+		{
+			fprintf(stderr, "Invalid format string: %s\n", opts.format);
+			return EXIT_FAILURE;
+		}
+		state.plan = &plan;
+	}
+
+	// Set up sampling, if requested
+	sampler_s sampler;
+	if (opts.sample || opts.budget)
+	{
+		if (opts.sample && !(opts.sample > 0.0 && opts.sample <= 1.0))
+		{
+			fputs("Sampling fraction must be greater than 0 and at most 1\n", stderr);
+			return EXIT_FAILURE;
+		}
+		if (opts.budget < 0)
+		{
+			fputs("Message budget must be a positive number\n", stderr);
+			return EXIT_FAILURE;
+		}
+		sampler_init(&sampler, opts.sample ? opts.sample : 1.0, opts.budget);
+		state.sampler = &sampler;
+	}
+
+	// Allocate the scratch memory for processing messages up front
+	if (arena_init(&state.arena, ARENA_SIZE) == -1)
+	{
+		fputs("Error allocating memory\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	// Open the archive, fan-out server, shared-memory ring and metrics
+	// endpoint, if requested
+	int err = outputs_open(&state);
+
+	// Play back an archive instead of connecting, if requested; this 
+	// doesn't require a terminal, so we can live without its size
+	if (err == 0 && opts.playback)
+	{
+		term_size(&(opts.term_width), &(opts.term_height));
+		running = 1;
+
+		if ((err = archive_play(&state, opts.playback, opts.from, opts.to ? opts.to : UINT64_MAX)) == -1)
+		{
+			fprintf(stderr, "Error reading archive %s\n", opts.playback);
+		}
+	}
+	else if (err == 0)
+	{
+		err = run(&state);
+	}
+
+	err |= outputs_close(&state);
+	arena_free(&state.arena);
+
+#ifdef ALLOC_STATS
+	fprintf(stderr, "*** Allocations: %zu, %zu in the hot path after warm-up (%zu messages), "
+			"%zu in twirc_tick() (libtwirc, not checked)\n",
+			allocs, allocs_hot, processed, allocs_tick);
+	err |= allocs_hot ? -1 : 0;
+#endif
+
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
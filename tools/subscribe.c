@@ -0,0 +1,72 @@
+#include <stdio.h>      // fprintf(), printf()
+#include <string.h>     // strlen(), memchr()
+#include <stdlib.h>     // EXIT_FAILURE, EXIT_SUCCESS
+#include <unistd.h>     // read(), write(), usleep()
+#include <sys/socket.h> // socket(), connect()
+#include <sys/un.h>     // struct sockaddr_un
+
+/*
+ * Subscribes to lurp's fan-out server at a socket path, reads events until
+ * lurp closes the connection and then prints how many it got, for testing
+ * the fan-out server (see the alloc-test script). As it might get started
+ * before lurp, it keeps trying to connect for a few seconds.
+ */
+
+#define SUBSCRIBE_TRIES 5000    // attempts to connect, 1 ms apart
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage:\n\t%s PATH SUBSCRIPTION\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(argv[1]) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path too long: %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	memcpy(addr.sun_path, argv[1], strlen(argv[1]));
+
+	int fd = -1;
+	for (int i = 0; i < SUBSCRIBE_TRIES && fd == -1; ++i)
+	{
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd != -1 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+		{
+			close(fd);
+			fd = -1;
+			usleep(1000);
+		}
+	}
+	if (fd == -1)
+	{
+		fprintf(stderr, "Error connecting to %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	char buf[65536];
+	int len = snprintf(buf, sizeof(buf), "%s\n", argv[2]);
+	if (write(fd, buf, len) != len)
+	{
+		fprintf(stderr, "Error subscribing to %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	size_t events = 0;
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		for (char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; ++p)
+		{
+			++events;
+		}
+	}
+	close(fd);
+
+	printf("%zu\n", events);
+	return n == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,146 @@
+/*
+ * Writes an archive of a synthetic chat stream, for testing lurp's playback
+ * and the outputs it feeds, for example with a build that counts allocations
+ * (see the alloc-test script). The archive gets written by lurp's own
+ * archive_write(), so this builds on top of src/lurp.c, with its main()
+ * renamed; link it like lurp itself.
+ *
+ * There are lots of chatters, each with their own nick, display name and
+ * color and one of many badges, so that the dictionary keeps growing. Some
+ * messages are actions, some get deleted again, some chatters time out,
+ * some subscribe and the chat settings change now and then.
+ */
+
+#define main lurp_main
+#include "../src/lurp.c"
+#undef main
+
+#define SYNTH_USERS  50000      // distinct chatters
+#define SYNTH_START  1700000000000 // time of the first message (ms)
+#define SYNTH_STR    64         // max length of a generated string
+
+/*
+ * Formats an id that looks like a version 4 UUID, derived from n, into buf.
+ */
+static void
+synth_id(uint64_t n, char *buf)
+{
+	unsigned char uuid[16];
+	uint64_t hi = n * 0x9E3779B97F4A7C15ull;
+	for (int i = 0; i < 8; ++i)
+	{
+		uuid[i] = (hi >> (i * 8)) & 0xFF;
+		uuid[i + 8] = (n >> (i * 8)) & 0xFF;
+	}
+	uuid[6] = (uuid[6] & 0x0F) | 0x40;
+	uuid[8] = (uuid[8] & 0x3F) | 0x80;
+	uuid_format(uuid, buf);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage:\n\t%s MESSAGES FILE\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	uint64_t total = strtoull(argv[1], NULL, 10);
+	archive_s *arc = archive_open(argv[2]);
+	if (arc == NULL)
+	{
+		fprintf(stderr, "Error creating %s\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	char const *words[] = {
+		"Kappa", "PogChamp", "gg", "what", "a", "play", "LUL", "no", "way",
+		"that", "was", "insane", "monkaS", "hello", "chat", "ez", "clip", "it"
+	};
+	size_t num_words = sizeof(words) / sizeof(words[0]);
+
+	char nick[SYNTH_STR], dname[SYNTH_STR], color[SYNTH_STR], badges[SYNTH_STR];
+	char id[UUID_BUFFER], del[UUID_BUFFER];
+	char text[512];
+	char none[] = "";
+	int err = 0;
+
+	uint64_t seed = 1;
+	for (uint64_t n = 0; n < total; ++n)
+	{
+		// Grow the dictionary and index in between messages, like lurp does
+		if (n % 1024 == 0 && archive_reserve(arc) == -1)
+		{
+			err = 1;
+			break;
+		}
+
+		// xorshift, good enough to pick users and words
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		unsigned user = seed % SYNTH_USERS;
+
+		size_t len = 0;
+		for (size_t w = 0; w < 1 + (seed >> 20) % 24; ++w)
+		{
+			len += snprintf(text + len, sizeof(text) - len, "%s%s",
+					w ? " " : "", words[(seed >> (w % 40)) % num_words]);
+		}
+
+		snprintf(nick, SYNTH_STR, "user%u", user);
+		snprintf(dname, SYNTH_STR, "User%u", user);
+		snprintf(color, SYNTH_STR, "#%06X", (user * 2654435761u) & 0xFFFFFF);
+		snprintf(badges, SYNTH_STR, "%s/%u,premium/1", user % 10 ? "subscriber" : "moderator", user % 97);
+		synth_id(n, id);
+
+		message_s m = {
+			.ts     = SYNTH_START + n * 7,
+			.chan   = "#synth",
+			.nick   = nick,
+			.dname  = dname,
+			.color  = color,
+			.badges = badges,
+			.id     = id,
+			.text   = text,
+			.action = n % 17 == 0
+		};
+		err |= archive_write(arc, &m) == -1;
+
+		// Delete a recent message now and then, time out a chatter less often
+		if (n % 50 == 49)
+		{
+			synth_id(n - 7, del);
+			message_s t = { .ts = m.ts, .chan = m.chan, .nick = nick, .id = del, .text = none, .tombstone = 1 };
+			err |= archive_write(arc, &t) == -1;
+		}
+		if (n % 1000 == 999)
+		{
+			message_s t = { .ts = m.ts, .chan = m.chan, .nick = nick, .text = none, .tombstone = 1 };
+			err |= archive_write(arc, &t) == -1;
+		}
+
+		// Someone subscribes now and then, the slow mode changes less often
+		if (n % 300 == 150)
+		{
+			snprintf(text, sizeof(text), "%s subscribed for %u months!", dname, user % 40 + 1);
+			message_s s = { .ts = m.ts, .chan = m.chan, .nick = nick, .dname = dname,
+				.color = color, .badges = badges, .text = text, .notice = 1 };
+			err |= archive_write(arc, &s) == -1;
+		}
+		if (n % 5000 == 2500)
+		{
+			snprintf(text, sizeof(text), "Chat settings: slow %s", n % 10000 == 2500 ? "30s" : "off");
+			message_s s = { .ts = m.ts, .chan = m.chan, .text = text, .notice = 1 };
+			err |= archive_write(arc, &s) == -1;
+		}
+	}
+
+	if (archive_close(arc) == -1 || err)
+	{
+		fprintf(stderr, "Error writing %s\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}